@@ -0,0 +1,54 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+/** Pack images into a baked atlas file ahead of time, so that the
+ * game can load it with Atlas::LoadBaked instead of decoding and
+ * packing the images at startup.
+ *
+ *     atlas-bake [-max-size N] output.atlas image.png ...
+ *
+ * Image ids are in the order of the images on the command line.
+ */
+
+#include "atlas.h"
+#include "worker-pool.h"
+#include "common.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+int main(int argc, char** argv) {
+  // There's no GL context to ask for GL_MAX_TEXTURE_SIZE, so the
+  // page size limit has to be chosen here. The web build keeps its
+  // pages at 2048 to fit in its memory, and LoadBaked refuses larger
+  // pages, so that's the default; use -max-size 4096 for an atlas
+  // that's only for the native build.
+  int max_size = 2048;
+  int arg = 1;
+  if (arg + 1 < argc && strcmp(argv[arg], "-max-size") == 0) {
+    max_size = atoi(argv[arg + 1]);
+    arg += 2;
+  }
+  if (arg + 1 >= argc || max_size <= 0) {
+    std::cerr << "Usage: " << argv[0] << " [-max-size N] output.atlas image.png ..." << std::endl;
+    return EXIT_FAILURE;
+  }
+  const char* output = argv[arg++];
+
+  Atlas atlas;
+  WorkerPool workers;
+  atlas.SetMaxPageSize(max_size);
+  atlas.LoadImages(std::vector<std::string>(argv + arg, argv + argc), &workers);
+  atlas.NumPages();
+  if (!atlas.SaveBaked(output)) { FAIL("SaveBaked"); }
+
+  AtlasStats stats = atlas.GetStats();
+  std::cout << output << ": " << stats.images << " images on " << stats.pages << " pages, "
+            << int(100 * stats.Occupancy()) << "% occupied";
+  if (stats.unpacked > 0) { std::cout << ", " << stats.unpacked << " did not fit"; }
+  std::cout << std::endl;
+  return EXIT_SUCCESS;
+}
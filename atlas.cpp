@@ -3,110 +3,782 @@
 
 #include "atlas.h"
 #include "glwrappers.h"
+#include "worker-pool.h"
 #include "common.h"
 
 #include <SDL.h>
 #include <SDL_image.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+
 #define STB_RECT_PACK_IMPLEMENTATION
 #include <stb/stb_rect_pack.h>
 
 // How many pixels to leave around each sprite
 const int PADDING = 1;
 
+// Pages start at this size and double until the images fit
+const int INITIAL_PAGE_SIZE = 1024;
+const int MAX_PAGE_SIZE = 4096;
+
+// Each page is also an RGBA surface in memory, 64MB at 4096x4096. The
+// web build has a fixed amount of memory (TOTAL_MEMORY in the
+// Makefile), so its pages stop at 2048x2048. If a page can't be
+// allocated anyway, pages get smaller, down to MIN_PAGE_SIZE, and the
+// images spill onto more of them.
+#ifdef __EMSCRIPTEN__
+const int MAX_PAGE_SIZE_IN_MEMORY = 2048;
+#else
+const int MAX_PAGE_SIZE_IN_MEMORY = MAX_PAGE_SIZE;
+#endif
+const int MIN_PAGE_SIZE = 128;
+
+/* Each page is packed with its own stbrp context. Once the atlas is
+   built, new images are packed into the space left over in a page,
+   using the same context. The context points into the nodes and into
+   itself, so a page can't be moved or have its nodes resized after
+   stbrp_init_target. */
+struct AtlasPage {
+  int size;
+  SDL_Surface* surface;
+  stbrp_context context;
+  std::vector<stbrp_node> nodes;
+  std::vector<SDL_Rect> added;
+  bool baked; // pixels are from a baked file, with no free space to pack into
+
+  AtlasPage(int size_);
+  AtlasPage(int size_, void* pixels);
+  ~AtlasPage();
+  bool Allocate();
+};
+
+/* A baked atlas file has the header, then the SpriteLocation for each
+   image, then the size of each page, then the RGBA pixels of each
+   page. Images that didn't fit on any page have page -1. Everything is 4-byte aligned and in the byte order of the
+   machine that baked it, so that the pages can be used in place from
+   a memory mapped file. */
+struct BakedHeader {
+  char magic[8];
+  uint32_t num_pages;
+  uint32_t num_images;
+};
+
+const char BAKED_MAGIC[8] = {'R', 'B', 'A', 'T', 'L', 'A', 'S', '2'};
+static_assert(sizeof(SpriteLocation) % 4 == 0, "baked file needs 4-byte alignment");
+
 /* For each sprite id, I want to keep its original surface
-   and its current location in the texture atlas */
+   and its current location in the texture atlas. After the surfaces
+   are released, images from files are read again if the atlas has
+   to be rebuilt. */
 
 struct AtlasImpl {
-  int size;
-  SDL_Surface* atlas;
+  int max_size;
+  bool built;
+  std::vector<std::unique_ptr<AtlasPage>> pages;
   std::vector<SDL_Surface*> sources;
+  std::vector<std::string> filenames; // empty if not from a file
+  std::vector<SDL_Rect> trimmed; // part of the source that gets packed
   std::vector<SpriteLocation> mapping;
+  std::vector<bool> packed;
+  int generation;
+  TextureFormat texture_format;
+  bool dither;
+  bool released; // pages only have the images added since the release
+
+  // A baked atlas keeps its file mapped while the pages use it
+  void* baked_data;
+  size_t baked_size;
+  std::vector<char> baked_buffer; // without mmap
+
+  void MaxSize();
+  stbrp_rect Rect(int i) const;
+  bool PackInto(int p, stbrp_rect& rect);
+  void Place(int p, const stbrp_rect& rect);
+  void Unpacked(int i, bool out_of_memory = false);
+  void Build();
+  bool AddToPages(int i);
+  void SourceFromPage(int i);
+  void ReloadSource(int i);
+  SDL_Surface* PageSurface(int p);
+  void ReleaseBaked();
 };
 
 
+// The surface is allocated only once the page is going to be used,
+// not while trying out sizes to pack into
+AtlasPage::AtlasPage(int size_): size(size_), surface(nullptr), baked(false) {
+  nodes.resize(size);
+  stbrp_init_target(&context, size, size, nodes.data(), nodes.size());
+}
+
+AtlasPage::AtlasPage(int size_, void* pixels): size(size_), baked(true) {
+  surface = SDL_CreateRGBSurfaceFrom
+    (pixels, size, size, 32, size * 4,
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+     0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff
+#else
+     0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000
+#endif
+     );
+  if (surface == nullptr) { FAIL("SDL_CreateRGBSurfaceFrom"); }
+}
+
+AtlasPage::~AtlasPage() {
+  SDL_FreeSurface(surface);
+}
+
+// Returns false if there isn't enough memory, instead of failing
+// like CreateRGBASurface
+bool AtlasPage::Allocate() {
+  if (surface == nullptr) {
+    surface = SDL_CreateRGBSurface
+      (0, size, size, 32,
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+       0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff
+#else
+       0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000
+#endif
+       );
+  }
+  return surface != nullptr;
+}
+
+
 Atlas::Atlas(): self(new AtlasImpl) {
-  // TODO: figure out sizing later
-  self->size = 1024;
-  self->atlas = nullptr;
+  self->max_size = 0;
+  self->built = false;
+  self->generation = 0;
+  self->baked_data = nullptr;
+  self->baked_size = 0;
+  self->texture_format = TextureFormat::RGBA8;
+  self->dither = false;
+  self->released = false;
+}
+
+Atlas::~Atlas() {
+  for (SDL_Surface* source : self->sources) {
+    SDL_FreeSurface(source);
+  }
+  self->pages.clear();
+  self->ReleaseBaked();
 }
 
-Atlas::~Atlas() {}
+
+void Atlas::SetMaxPageSize(int size) {
+  self->max_size = std::min(size, MAX_PAGE_SIZE);
+}
 
 
 const SpriteLocation& Atlas::GetLocation(int id) const {
   return self->mapping.at(id);
 }
 
+int Atlas::NumImages() const {
+  return self->mapping.size();
+}
+
+
+namespace {
+  /** The smallest rect containing all the pixels that aren't fully
+   * transparent. Surfaces without an alpha channel aren't trimmed.
+   * Returns an empty rect if all the pixels are transparent.
+   */
+  SDL_Rect VisibleBounds(SDL_Surface* surface) {
+    SDL_Rect bounds = {0, 0, surface->w, surface->h};
+    const SDL_PixelFormat* format = surface->format;
+    if (format->BytesPerPixel != 4 || format->Amask == 0) { return bounds; }
+
+    if (SDL_MUSTLOCK(surface)) { SDL_LockSurface(surface); }
+    int x0 = surface->w, y0 = surface->h, x1 = -1, y1 = -1;
+    for (int y = 0; y < surface->h; y++) {
+      const Uint32* row = reinterpret_cast<const Uint32*>
+        (static_cast<const Uint8*>(surface->pixels) + y * surface->pitch);
+      for (int x = 0; x < surface->w; x++) {
+        if (row[x] & format->Amask) {
+          x0 = std::min(x0, x); x1 = std::max(x1, x);
+          y0 = std::min(y0, y); y1 = std::max(y1, y);
+        }
+      }
+    }
+    if (SDL_MUSTLOCK(surface)) { SDL_UnlockSurface(surface); }
 
-int Atlas::AddSurface(SDL_Surface* surface) {
-  // The previous atlas is no longer valid
-  if (self->atlas) {
-    SDL_FreeSurface(self->atlas);
-    self->atlas = nullptr;
+    if (x1 < 0) { return SDL_Rect{0, 0, 0, 0}; }
+    return SDL_Rect{x0, y0, x1 - x0 + 1, y1 - y0 + 1};
   }
-  
+}
+
+
+int Atlas::AddSurface(SDL_Surface* surface, bool trim) {
   int id = self->mapping.size();
   self->sources.push_back(surface);
+  self->filenames.emplace_back();
+  self->packed.push_back(false);
   self->mapping.emplace_back();
+
+  // The quad covers -0.5 to +0.5 for the whole surface, so that
+  // trimming the transparent border doesn't change how it looks;
+  // only the part of the quad covering the visible pixels is drawn.
+  SDL_Rect bounds = trim? VisibleBounds(surface) : SDL_Rect{0, 0, surface->w, surface->h};
   SpriteLocation& loc = self->mapping.back();
-  loc.x0 = -0.5;
-  loc.x1 = +0.5;
-  loc.y0 = -0.5;
-  loc.y1 = +0.5;
+  loc.x0 = -0.5f + float(bounds.x) / surface->w;
+  loc.x1 = -0.5f + float(bounds.x + bounds.w) / surface->w;
+  loc.y0 = -0.5f + float(bounds.y) / surface->h;
+  loc.y1 = -0.5f + float(bounds.y + bounds.h) / surface->h;
+  loc.page = 0;
   // s0,t0,s1,t1 will be filled in during the packing phase
 
+  // A fully transparent image still needs a place in the atlas, but
+  // its quad has no area
+  if (bounds.w == 0 || bounds.h == 0) {
+    bounds = SDL_Rect{0, 0, 1, 1};
+    loc.x1 = loc.x0;
+    loc.y1 = loc.y0;
+  }
+  self->trimmed.push_back(bounds);
+
+  // If the atlas has already been built, try to fit the new image
+  // into the free space; if it doesn't fit, the atlas is no longer
+  // valid and will have to be rebuilt
+  if (self->built && !self->AddToPages(id)) {
+    self->built = false;
+  }
+  
   return id;
 }
 
-int Atlas::LoadImage(const char* filename) {
+int Atlas::LoadImage(const char* filename, bool trim) {
   SDL_Surface* surface = IMG_Load(filename);
   if (surface == nullptr) { FAIL("Unable to load image"); }
-  return AddSurface(surface);
+  int id = AddSurface(surface, trim);
+  self->filenames[id] = filename;
+  return id;
 }
 
 
-/** If the surface hasn't been built, or if the set of sprites has
- * changed, build the surface, and return it. 
+std::vector<int> Atlas::LoadImages(const std::vector<std::string>& filenames,
+                                   WorkerPool* workers) {
+  // SDL_image sets up its decoders the first time they're used, and
+  // that isn't safe to do from several threads at once
+  IMG_Init(IMG_INIT_PNG);
+
+  // Each image is decoded into its own slot, so the order they finish
+  // in doesn't matter
+  int n = filenames.size();
+  std::vector<SDL_Surface*> surfaces(n, nullptr);
+  auto decode = [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      surfaces[i] = IMG_Load(filenames[i].c_str());
+    }
+  };
+  if (workers != nullptr) {
+    workers->ParallelFor(n, 1, decode);
+  } else {
+    decode(0, n);
+  }
+
+  std::vector<int> ids;
+  for (int i = 0; i < n; i++) {
+    if (surfaces[i] == nullptr) {
+      std::cerr << filenames[i] << ": ";
+      FAIL("Unable to load image");
+    }
+    ids.push_back(AddSurface(surfaces[i]));
+    self->filenames[ids.back()] = filenames[i];
+  }
+  return ids;
+}
+
+
+void AtlasImpl::MaxSize() {
+  // This needs a GL context, so I wait until the first build
+  if (max_size == 0) {
+    GLint max_texture_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    max_size = max_texture_size > 0? std::min(int(max_texture_size), MAX_PAGE_SIZE_IN_MEMORY)
+      : MAX_PAGE_SIZE_IN_MEMORY;
+  }
+}
+
+
+stbrp_rect AtlasImpl::Rect(int i) const {
+  stbrp_rect rect;
+  rect.id = i;
+  rect.w = 2*PADDING + trimmed[i].w;
+  rect.h = 2*PADDING + trimmed[i].h;
+  return rect;
+}
+
+
+bool AtlasImpl::PackInto(int p, stbrp_rect& rect) {
+  stbrp_pack_rects(&pages[p]->context, &rect, 1);
+  return rect.was_packed;
+}
+
+
+void AtlasImpl::Place(int p, const stbrp_rect& packed_rect) {
+  AtlasPage& page = *pages[p];
+  int i = packed_rect.id;
+  SDL_Rect rect;
+  rect.x = PADDING + packed_rect.x; rect.y = PADDING + packed_rect.y;
+  rect.w = trimmed[i].w; rect.h = trimmed[i].h;
+  if (SDL_BlitSurface(sources[i], &trimmed[i], PageSurface(p), &rect) < 0) {
+    FAIL("SDL_BlitSurface");
+  }
+      
+  mapping[i].s0 = float(rect.x) / page.size;
+  mapping[i].s1 = float(rect.x + rect.w) / page.size;
+  mapping[i].t0 = float(rect.y) / page.size;
+  mapping[i].t1 = float(rect.y + rect.h) / page.size;
+  mapping[i].page = p;
+  packed[i] = true;
+  page.added.push_back(rect);
+}
+
+
+void AtlasImpl::Unpacked(int i, bool out_of_memory) {
+  // The image is bigger than a page can be, or there's no memory for
+  // another page. Rather than stop the program, I draw nothing for it.
+  std::cerr << "Atlas: image " << i << " (" << trimmed[i].w << "x" << trimmed[i].h << ") ";
+  if (out_of_memory) {
+    std::cerr << "has no memory for a new page" << std::endl;
+  } else {
+    std::cerr << "does not fit in a " << max_size << "x" << max_size << " page" << std::endl;
+  }
+  SpriteLocation& loc = mapping[i];
+  loc.x0 = loc.y0 = loc.x1 = loc.y1 = 0.0f;
+  loc.s0 = loc.t0 = loc.s1 = loc.t1 = 0.0f;
+  loc.page = 0;
+  packed[i] = false;
+}
+
+
+/** Pack all the images from scratch. Packing them all at once gives
+ * stbrp a chance to sort them, so it packs better than adding them
+ * one at a time. Each page grows until everything fits or it reaches
+ * the maximum size, and then the rest go onto the next page.
  */
-SDL_Surface* Atlas::GetSurface() {
-  if (self->atlas == nullptr) {
-    self->atlas = CreateRGBASurface(self->size, self->size);
+void AtlasImpl::Build() {
+  MaxSize();
+  // Images from a baked file don't have their own surfaces, so I
+  // copy them out of the baked pages before those go away. Released
+  // images are read from their files again.
+  for (unsigned i = 0; i < sources.size(); i++) {
+    if (sources[i] != nullptr) { continue; }
+    if (!filenames[i].empty()) {
+      ReloadSource(i);
+    } else {
+      SourceFromPage(i);
+    }
+  }
+  pages.clear();
+  ReleaseBaked();
+  std::vector<stbrp_rect> remaining;
+  for (unsigned i = 0; i < sources.size(); i++) {
+    remaining.push_back(Rect(i));
+  }
+
+  while (!remaining.empty()) {
     std::vector<stbrp_rect> rects;
-    std::vector<stbrp_node> working_space;
-    stbrp_context context;
+    for (int size = std::min(INITIAL_PAGE_SIZE, max_size); ; size *= 2) {
+      rects = remaining;
+      pages.emplace_back(new AtlasPage(size));
+      stbrp_pack_rects(&pages.back()->context, rects.data(), rects.size());
+      bool all_packed = std::all_of(rects.begin(), rects.end(),
+                                    [](const stbrp_rect& r) { return r.was_packed; });
+      if (all_packed || size * 2 > max_size) { break; }
+      pages.pop_back();
+    }
+
+    if (std::none_of(rects.begin(), rects.end(),
+                     [](const stbrp_rect& r) { return r.was_packed; })) {
+      // Nothing fit even on an empty page, so nothing else will
+      pages.pop_back();
+      for (const stbrp_rect& rect : remaining) {
+        Unpacked(rect.id);
+      }
+      break;
+    }
 
-    rects.resize(self->sources.size());
-    for (unsigned i = 0; i < self->sources.size(); i++) {
-      rects[i].id = i;
-      rects[i].w = 2*PADDING + self->sources[i]->w;
-      rects[i].h = 2*PADDING + self->sources[i]->h;
+    if (!pages.back()->Allocate()) {
+      // Pages can't be this big, so I pack the same images again
+      // onto smaller ones
+      int size = pages.back()->size;
+      pages.pop_back();
+      if (size / 2 < MIN_PAGE_SIZE) { FAIL("Unable to allocate an atlas page"); }
+      std::cerr << "Atlas: not enough memory for a " << size << "x" << size
+                << " page; using smaller pages" << std::endl;
+      max_size = size / 2;
+      continue;
     }
-      
-    working_space.resize(self->size);
-    stbrp_init_target(&context, self->size, self->size,
-                      working_space.data(), working_space.size());
-    stbrp_pack_rects(&context, rects.data(), rects.size());
 
-    for (unsigned i = 0; i < self->sources.size(); i++) {
-      if (!rects[i].was_packed) { FAIL("Could not fit all images"); }
-      
-      SDL_Rect rect;
-      rect.x = PADDING + rects[i].x; rect.y = PADDING + rects[i].y;
-      rect.w = self->sources[i]->w; rect.h = self->sources[i]->h;
-      if (SDL_BlitSurface(self->sources[i], nullptr, self->atlas, &rect) < 0) {
-        FAIL("SDL_BlitSurface");
+    int p = pages.size() - 1;
+    remaining.clear();
+    for (const stbrp_rect& rect : rects) {
+      if (rect.was_packed) {
+        Place(p, rect);
+      } else {
+        remaining.push_back(rect);
       }
-      
-      self->mapping[i].s0 = float(rect.x) / self->size;
-      self->mapping[i].s1 = float(rect.x + rect.w) / self->size;
-      self->mapping[i].t0 = float(rect.y) / self->size;
-      self->mapping[i].t1 = float(rect.y + rect.h) / self->size;
     }
   }
+  
+  for (auto& page : pages) {
+    page->added.clear();
+  }
+  generation++;
+  built = true;
+  released = false;
+}
+
+
+/** Try to add one image without moving the others. Returns false if
+ * the atlas has to be rebuilt to make a page bigger.
+ */
+bool AtlasImpl::AddToPages(int i) {
+  stbrp_rect rect = Rect(i);
+  for (int p = 0; p < int(pages.size()); p++) {
+    if (!pages[p]->baked && PackInto(p, rect)) {
+      Place(p, rect);
+      return true;
+    }
+  }
+  if (!pages.empty() && !pages.back()->baked && pages.back()->size < max_size) {
+    return false;
+  }
+
+  // All the pages are full size, so start a new one that's just big
+  // enough
+  for (int size = std::min(INITIAL_PAGE_SIZE, max_size); size <= max_size; size *= 2) {
+    if (rect.w <= size && rect.h <= size) {
+      pages.emplace_back(new AtlasPage(size));
+      if (PackInto(pages.size() - 1, rect)) {
+        if (!pages.back()->Allocate()) {
+          pages.pop_back();
+          Unpacked(i, true);
+          return true;
+        }
+        Place(pages.size() - 1, rect);
+        return true;
+      }
+      pages.pop_back();
+    }
+  }
+  Unpacked(i);
+  return true;
+}
+
+
+int Atlas::NumPages() {
+  if (!self->built) {
+    self->Build();
+  }
+  return self->pages.size();
+}
+
+
+/** If the atlas hasn't been built, or if a page had to grow, build
+ * the surfaces, and return one of them.
+ */
+SDL_Surface* Atlas::GetSurface(int page) {
+  if (!self->built) {
+    self->Build();
+  }
+  return self->PageSurface(page);
+}
+
+
+/** A released page gets a blank surface when something needs one, so
+ * that images added later have somewhere to go. Only the added rects
+ * of it are meaningful.
+ */
+SDL_Surface* AtlasImpl::PageSurface(int p) {
+  AtlasPage& page = *pages.at(p);
+  if (!page.Allocate()) { FAIL("Unable to allocate an atlas page"); }
+  return page.surface;
+}
+
+
+/** Once the pages are on the GPU, neither the sources nor the pages
+ * are needed until the atlas is rebuilt. Images from files can be
+ * read again then; the others keep a copy of just their packed
+ * pixels, which is no bigger than the source. Baked pages stay, but
+ * they're mapped from the file, so the system can drop them anyway.
+ */
+void Atlas::ReleaseSurfaces() {
+  if (!self->built) { return; }
+  for (unsigned i = 0; i < self->sources.size(); i++) {
+    SDL_Surface* source = self->sources[i];
+    if (source == nullptr) { continue; }
+    const SDL_Rect& rect = self->trimmed[i];
+    bool tight = rect.x == 0 && rect.y == 0 && rect.w == source->w && rect.h == source->h;
+    if (!self->filenames[i].empty()) {
+      SDL_FreeSurface(source);
+      self->sources[i] = nullptr;
+    } else if (self->packed[i] && !tight) {
+      self->SourceFromPage(i);
+      SDL_FreeSurface(source);
+    }
+  }
+  for (auto& page : self->pages) {
+    if (!page->baked) {
+      SDL_FreeSurface(page->surface);
+      page->surface = nullptr;
+    }
+  }
+  self->released = true;
+}
+
+
+void Atlas::Rebuild() {
+  self->built = false;
+}
+
+
+int Atlas::GetGeneration() const {
+  return self->generation;
+}
+
+
+std::vector<SDL_Rect> Atlas::TakeAddedRects(int page) {
+  std::vector<SDL_Rect> added;
+  added.swap(self->pages.at(page)->added);
+  return added;
+}
+
+
+AtlasStats Atlas::GetStats() const {
+  AtlasStats stats = {};
+  stats.pages = self->pages.size();
+  stats.images = self->mapping.size();
+  for (const auto& page : self->pages) {
+    stats.page_pixels += long(page->size) * page->size;
+  }
+  for (unsigned i = 0; i < self->mapping.size(); i++) {
+    if (!self->packed[i]) {
+      stats.unpacked++;
+      continue;
+    }
+    // Baked images don't have sources, so I measure them in the page
+    const SpriteLocation& loc = self->mapping[i];
+    int size = self->pages[loc.page]->size;
+    long w = std::lround((loc.s1 - loc.s0) * size), h = std::lround((loc.t1 - loc.t0) * size);
+    stats.used_pixels += (w + 2*PADDING) * (h + 2*PADDING);
+    stats.image_pixels += w * h;
+  }
+  return stats;
+}
+
 
-  return self->atlas;
+void Atlas::SetTextureFormat(TextureFormat format, bool dither) {
+  self->texture_format = format;
+  self->dither = dither;
+}
+
+TextureFormat Atlas::GetTextureFormat() const {
+  return self->texture_format;
+}
+
+bool Atlas::GetDither() const {
+  return self->dither;
+}
+
+
+void AtlasImpl::ReloadSource(int i) {
+  // The trimmed rect is still right, as long as the file hasn't changed
+  SDL_Surface* source = IMG_Load(filenames[i].c_str());
+  if (source == nullptr) {
+    std::cerr << filenames[i] << ": ";
+    FAIL("Unable to reload image");
+  }
+  sources[i] = source;
+}
+
+
+void AtlasImpl::SourceFromPage(int i) {
+  // Images the baker couldn't fit have no pixels, and may not have a
+  // page to read them from
+  if (!packed[i]) {
+    sources[i] = CreateRGBASurface(1, 1);
+    trimmed[i] = SDL_Rect{0, 0, 1, 1};
+    return;
+  }
+  const SpriteLocation& loc = mapping[i];
+  AtlasPage& page = *pages[loc.page];
+  SDL_Rect rect;
+  rect.x = int(std::lround(loc.s0 * page.size));
+  rect.y = int(std::lround(loc.t0 * page.size));
+  rect.w = int(std::lround(loc.s1 * page.size)) - rect.x;
+  rect.h = int(std::lround(loc.t1 * page.size)) - rect.y;
+  // SDL can't make an empty surface
+  rect.w = std::max(rect.w, 1);
+  rect.h = std::max(rect.h, 1);
+  SDL_Surface* source = CreateRGBASurface(rect.w, rect.h);
+  SDL_SetSurfaceBlendMode(page.surface, SDL_BLENDMODE_NONE);
+  if (SDL_BlitSurface(page.surface, &rect, source, nullptr) < 0) {
+    FAIL("SDL_BlitSurface");
+  }
+  sources[i] = source;
+  trimmed[i] = SDL_Rect{0, 0, rect.w, rect.h};
+}
+
+
+bool Atlas::SaveBaked(const char* path) {
+  // Released pages only have the images added since, so I need to
+  // put all of them back first
+  if (self->released) { self->built = false; }
+  int num_pages = NumPages();
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) { return false; }
+  BakedHeader header;
+  std::copy(BAKED_MAGIC, BAKED_MAGIC + 8, header.magic);
+  header.num_pages = num_pages;
+  header.num_images = self->mapping.size();
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  // Unpacked images are on page 0 in memory, so that drawing them
+  // doesn't need a special case, but the file has to tell them apart
+  std::vector<SpriteLocation> mapping = self->mapping;
+  for (unsigned i = 0; i < mapping.size(); i++) {
+    if (!self->packed[i]) { mapping[i].page = -1; }
+  }
+  ok = ok && fwrite(mapping.data(), sizeof(SpriteLocation), mapping.size(), file)
+    == mapping.size();
+  for (const auto& page : self->pages) {
+    uint32_t size = page->size;
+    ok = ok && fwrite(&size, sizeof(size), 1, file) == 1;
+  }
+  for (int p = 0; p < num_pages; p++) {
+    SDL_Surface* surface = self->PageSurface(p);
+    for (int y = 0; ok && y < surface->h; y++) {
+      const char* row = static_cast<const char*>(surface->pixels) + y * surface->pitch;
+      ok = fwrite(row, 4, surface->w, file) == size_t(surface->w);
+    }
+  }
+  return fclose(file) == 0 && ok;
+}
+
+
+void AtlasImpl::ReleaseBaked() {
+#ifdef HAVE_MMAP
+  if (baked_data != nullptr && baked_buffer.empty()) {
+    munmap(baked_data, baked_size);
+  }
+#endif
+  baked_data = nullptr;
+  baked_size = 0;
+  std::vector<char>().swap(baked_buffer);
+}
+
+
+/** Map the file instead of reading it, so that only the parts that
+ * are used get read, and the pages can be uploaded straight from the
+ * file's pixels.
+ */
+bool Atlas::LoadBaked(const char* path) {
+  if (!self->mapping.empty()) {
+    std::cerr << "Atlas::LoadBaked: atlas already has images" << std::endl;
+    return false;
+  }
+  
+#ifdef HAVE_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return false; }
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    // Private and writable, so that SDL can have non-const pixels;
+    // the pages are never written to
+    void* data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      self->baked_data = data;
+      self->baked_size = info.st_size;
+    }
+  }
+  close(fd);
+#else
+  SDL_RWops* file = SDL_RWFromFile(path, "rb");
+  if (file != nullptr) {
+    self->baked_buffer.resize(SDL_RWsize(file));
+    if (SDL_RWread(file, self->baked_buffer.data(), self->baked_buffer.size(), 1) == 1) {
+      self->baked_data = self->baked_buffer.data();
+      self->baked_size = self->baked_buffer.size();
+    }
+    SDL_RWclose(file);
+  }
+#endif
+  if (self->baked_data == nullptr) { return false; }
+
+  // Check that everything the header says is there really is there
+  char* data = static_cast<char*>(self->baked_data);
+  size_t size = self->baked_size;
+  BakedHeader header;
+  bool ok = size >= sizeof(header);
+  if (ok) { memcpy(&header, data, sizeof(header)); }
+  ok = ok && std::equal(BAKED_MAGIC, BAKED_MAGIC + 8, header.magic)
+    && header.num_images <= size / sizeof(SpriteLocation)
+    && header.num_pages <= size / sizeof(uint32_t);
+  size_t offset = sizeof(header) + sizeof(SpriteLocation) * size_t(header.num_images);
+  size_t pixels_offset = offset + sizeof(uint32_t) * size_t(header.num_pages);
+  ok = ok && pixels_offset <= size;
+  std::vector<uint32_t> page_sizes(ok? header.num_pages : 0);
+  if (ok) { memcpy(page_sizes.data(), data + offset, sizeof(uint32_t) * page_sizes.size()); }
+  size_t end = pixels_offset;
+  for (uint32_t page_size : page_sizes) {
+    ok = ok && page_size > 0 && page_size <= uint32_t(MAX_PAGE_SIZE);
+    end += 4 * size_t(page_size) * page_size;
+  }
+  if (!ok || end > size) {
+    std::cerr << "Atlas::LoadBaked: " << path << " is not a valid baked atlas" << std::endl;
+    self->ReleaseBaked();
+    return false;
+  }
+
+  // The pages are used as they are, so they have to fit in a texture
+  // and in memory here, not just where they were baked
+  self->MaxSize();
+  uint32_t largest = page_sizes.empty()? 0 : *std::max_element(page_sizes.begin(), page_sizes.end());
+  if (largest > uint32_t(self->max_size)) {
+    std::cerr << "Atlas::LoadBaked: " << path << " has " << largest << "x" << largest
+              << " pages, but the limit here is " << self->max_size << "x" << self->max_size
+              << "; bake it with a smaller -max-size" << std::endl;
+    self->ReleaseBaked();
+    return false;
+  }
+
+  self->mapping.resize(header.num_images);
+  memcpy(self->mapping.data(), data + sizeof(header), sizeof(SpriteLocation) * header.num_images);
+  self->sources.assign(header.num_images, nullptr);
+  self->filenames.assign(header.num_images, std::string());
+  self->trimmed.assign(header.num_images, SDL_Rect{0, 0, 0, 0});
+  self->packed.assign(header.num_images, true);
+  for (unsigned i = 0; i < header.num_images; i++) {
+    SpriteLocation& loc = self->mapping[i];
+    if (loc.page < 0 || loc.page >= int(header.num_pages)) {
+      // The baker couldn't fit this one either
+      loc.x0 = loc.y0 = loc.x1 = loc.y1 = 0.0f;
+      loc.s0 = loc.t0 = loc.s1 = loc.t1 = 0.0f;
+      loc.page = 0;
+      self->packed[i] = false;
+    }
+  }
+  size_t page_offset = pixels_offset;
+  for (uint32_t page_size : page_sizes) {
+    self->pages.emplace_back(new AtlasPage(page_size, data + page_offset));
+    page_offset += 4 * size_t(page_size) * page_size;
+  }
+  
+  self->built = true;
+  self->generation++;
+  return true;
 }
@@ -5,13 +5,31 @@
 #define ATLAS_H
 
 #include <memory>
+#include <string>
+#include <vector>
 
 struct SDL_Surface;
+struct SDL_Rect;
+class WorkerPool;
+enum class TextureFormat;
 struct AtlasImpl;
 
 struct SpriteLocation {
   float x0, y0, x1, y1; // Corners in world coordinates
   float s0, t0, s1, t1; // Corners in texture coordinates
+  int page;             // Which surface the texture coordinates are in
+};
+
+struct AtlasStats {
+  int pages;
+  int images;
+  int unpacked;       // images too big for any page; they draw nothing
+  long page_pixels;   // in all the pages
+  long used_pixels;   // by packed images, including padding
+  long image_pixels;  // by packed images, not including padding
+
+  float Occupancy() const { return page_pixels? float(used_pixels) / page_pixels : 0.0f; }
+  long WastedPixels() const { return page_pixels - image_pixels; }
 };
 
 class Atlas {
@@ -19,15 +37,69 @@ public:
   Atlas();
   ~Atlas();
 
-  // An Atlas contains a set of surfaces
-  int LoadImage(const char* filename);
-  int AddSurface(SDL_Surface* surface);
+  // An Atlas contains a set of surfaces. Fully transparent borders
+  // are trimmed off, and the location's x0,y0,x1,y1 are moved in to
+  // match, so the sprite looks the same but uses less of the atlas.
+  // Sprite sheets shouldn't be trimmed, because their frames have to
+  // stay evenly spaced.
+  int LoadImage(const char* filename, bool trim = true);
+  int AddSurface(SDL_Surface* surface, bool trim = true);
+
+  // Decode the images on the workers, then add them in order, so
+  // that the ids are the same as loading them one at a time. Returns
+  // the ids. With no workers, decodes on the calling thread.
+  std::vector<int> LoadImages(const std::vector<std::string>& filenames,
+                              WorkerPool* workers = nullptr);
+
+  // Call these after images are loaded; they build the atlas if
+  // needed. Pages start at 1024x1024 and grow up to 4096x4096 (2048
+  // on the web, to fit in memory), or the GL_MAX_TEXTURE_SIZE if
+  // that's smaller, or smaller still if a page can't be allocated,
+  // before images spill over onto another page. Images added later are packed into the free
+  // space, or onto a new page if all the pages are full size; the
+  // whole atlas is only rebuilt when a page needs to grow.
+  int NumPages();
+  SDL_Surface* GetSurface(int page = 0);
 
-  // Call this after images are loaded.
-  SDL_Surface* GetSurface();
+  // The generation changes whenever the atlas is rebuilt, which moves
+  // every image. Between rebuilds, the added rects are the parts of
+  // the page that changed since the last call, to be copied to its
+  // texture, and new pages may have been added.
+  int GetGeneration() const;
+  std::vector<SDL_Rect> TakeAddedRects(int page);
+
+  // Free the decoded images and the pages once they've been copied
+  // to textures. A released page only has the images added since;
+  // the rest are read from their files again, or kept as a copy of
+  // their packed pixels, if the atlas has to be rebuilt. Rebuild
+  // forces that, such as when the textures have to be made again.
+  void ReleaseSurfaces();
+  void Rebuild();
 
   // Get image data for a given sprite id
   const SpriteLocation& GetLocation(int id) const;
+  int NumImages() const;
+
+  AtlasStats GetStats() const;
+
+  // The pages are kept as RGBA surfaces, but can be stored on the GPU
+  // in a smaller format (see Texture). This is for whoever makes the
+  // textures from the pages.
+  void SetTextureFormat(TextureFormat format, bool dither = false);
+  TextureFormat GetTextureFormat() const;
+  bool GetDither() const;
+
+  // Bake the packed pages and image locations into a file, to be
+  // loaded later without decoding or packing any images. LoadBaked
+  // has to be called before adding any images; the baked images get
+  // ids starting at 0. Both return false if the file can't be used,
+  // including when the baked pages are larger than this atlas's page
+  // size limit (see SetMaxPageSize).
+  bool SaveBaked(const char* path);
+  bool LoadBaked(const char* path);
+
+  // Override GL_MAX_TEXTURE_SIZE, such as when there is no GL context
+  void SetMaxPageSize(int size);
   
 private:
   std::unique_ptr<AtlasImpl> self;
@@ -0,0 +1,222 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+/** Checks that the fast versions of the renderer's code give the same
+ * results as the simple ones, on the machine it's compiled for.
+ *
+ *     make check
+ *
+ * Exits with failure if any of them differ. The sprite layer is drawn
+ * with and without instancing into a framebuffer object, in a hidden
+ * window. On Linux, make check runs it headless on Mesa's software
+ * renderer (llvmpipe), so the results don't depend on the GPU.
+ */
+
+#include "render-sprites.h"
+#include "render-sprites-internal.h"
+#include "font.h"
+#include "font-internal.h"
+#include "glwrappers.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+namespace {
+  const int WIDTH = 256, HEIGHT = 256;
+
+  // Expand random sprites with both the SIMD and the scalar vertex
+  // code. Returns how many came out different.
+  int CheckSpriteExpansion(int count) {
+    std::mt19937 rng(12345);
+    auto random = [&](float lo, float hi) {
+      return std::uniform_real_distribution<float>(lo, hi)(rng);
+    };
+    int mismatches = 0;
+    for (int i = 0; i < count; i++) {
+      Sprite S;
+      S.image_id = 0;
+      S.x = random(-1000.0f, 1000.0f);
+      S.y = random(-1000.0f, 1000.0f);
+      S.rotation_degrees = random(-720.0f, 720.0f);
+      S.scale = random(0.01f, 10.0f);
+      SpriteLocation loc{random(-2.0f, 0.0f), random(-2.0f, 0.0f),
+                         random(0.0f, 2.0f), random(0.0f, 2.0f),
+                         0.0f, 0.0f, 1.0f, 1.0f, 0};
+      QuadTexcoords tex{GLushort(rng()), GLushort(rng()), GLushort(rng()), GLushort(rng())};
+      Attributes scalar[4], simd[4];
+      memset(scalar, 0, sizeof(scalar));
+      memset(simd, 0, sizeof(simd));
+      ExpandSpriteScalar(S, loc, tex, scalar);
+      ExpandSprite(S, loc, tex, simd);
+      if (memcmp(scalar, simd, sizeof(scalar)) != 0) { mismatches++; }
+    }
+    return mismatches;
+  }
+
+  // Blend random rows of glyph pixels with both the SIMD and the
+  // scalar code. Returns how many rows came out different.
+  int CheckGlyphBlending(int count) {
+    std::mt19937 rng(12345);
+    auto random_byte = [&]() { return uint8_t(rng() & 0xff); };
+    int mismatches = 0;
+    for (int i = 0; i < count; i++) {
+      // Odd lengths also exercise the scalar tail of the SIMD versions
+      int n = int(rng() % 70);
+      std::vector<uint8_t> coverage(n), scalar(4 * n), simd;
+      for (uint8_t& c : coverage) { c = random_byte(); }
+      for (uint8_t& d : scalar) { d = random_byte(); }
+      simd = scalar;
+      uint8_t color[4] = {random_byte(), random_byte(), random_byte(), 255};
+      int alpha = random_byte();
+      BlendRowScalar(scalar.data(), coverage.data(), n, color, alpha);
+      BlendRow(simd.data(), coverage.data(), n, color, alpha);
+      if (scalar != simd) { mismatches++; }
+    }
+    return mismatches;
+  }
+
+  // Sprites covering the view, overlapping, at all angles. Half of
+  // them move and spin, and the ones using the sprite sheet are
+  // animated, so that the instanced shader's animation is compared
+  // with the cpu's.
+  std::vector<Sprite> MakeScene(int image, int sheet, bool depths) {
+    std::mt19937 rng(12345);
+    auto random = [&](float lo, float hi) {
+      return std::uniform_real_distribution<float>(lo, hi)(rng);
+    };
+    std::vector<Sprite> sprites;
+    for (int j = 0; j < 500; j++) {
+      Sprite S;
+      S.image_id = j % 3 == 0? sheet : image;
+      S.x = random(-1.2f, 1.2f);
+      S.y = random(-1.2f, 1.2f);
+      S.rotation_degrees = random(-180.0f, 180.0f);
+      S.scale = random(0.1f, 0.5f);
+      if (depths) { S.depth = int(rng() % 5) - 2; }
+      if (j % 2 == 0) {
+        S.vx = random(-0.2f, 0.2f);
+        S.vy = random(-0.2f, 0.2f);
+        S.angular_velocity = random(-90.0f, 90.0f);
+        S.start_time = random(0.0f, 1.0f);
+      }
+      if (S.image_id == sheet) {
+        S.num_frames = 2;
+        S.frame_rate = random(0.5f, 4.0f);
+      }
+      sprites.push_back(S);
+    }
+    return sprites;
+  }
+
+  std::vector<Uint8> ReadPixels() {
+    std::vector<Uint8> pixels(4 * WIDTH * HEIGHT);
+    glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    GLERRORS("glReadPixels");
+    return pixels;
+  }
+
+  /** Draw a scene with instancing, then switch it off and draw the
+   * scene again, like toggling it in the demo. The images can't be
+   * identical: the instanced shader rotates and animates on the gpu,
+   * in different float precision, so texture coordinates are off by
+   * a little everywhere, and a sprite's edge can cover a different
+   * pixel now and then. Those are small differences, or rare ones; a
+   * wrong angle, position or frame moves whole sprites and changes
+   * many pixels by a lot. Returns whether only a few pixels differ
+   * by more than a little.
+   */
+  bool CompareInstancing(SDL_Window* window, bool depths) {
+    RenderSprites layer;
+    if (!layer.SetInstancing(true)) {
+      std::cout << "instancing: not available in this GL context, skipped" << std::endl;
+      return true;
+    }
+    int image = layer.LoadImage("assets/red-blob.png");
+    int sheet = layer.LoadImage("assets/red-blob.png", 2);
+    layer.SetSprites(MakeScene(image, sheet, depths));
+    layer.SetTime(2.5f);
+
+    std::vector<Uint8> with, without;
+    glClear(GL_COLOR_BUFFER_BIT);
+    layer.Render(window, true);
+    with = ReadPixels();
+    layer.SetInstancing(false);
+    glClear(GL_COLOR_BUFFER_BIT);
+    layer.Render(window, false);
+    without = ReadPixels();
+
+    const int SMALL_DIFFERENCE = 8; // out of 255
+    const int MAX_LARGE_DIFFERENCES = WIDTH * HEIGHT / 1000;
+    int different = 0, large = 0;
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+      int difference = 0;
+      for (int k = 0; k < 4; k++) {
+        difference = std::max(difference, std::abs(with[4*i + k] - without[4*i + k]));
+      }
+      if (difference > 0) { different++; }
+      if (difference > SMALL_DIFFERENCE) { large++; }
+    }
+    std::cout << "instancing" << (depths? " with depths" : "") << ": "
+              << different << " of " << WIDTH * HEIGHT << " pixels differ, "
+              << large << " by more than " << SMALL_DIFFERENCE
+              << " (at most " << MAX_LARGE_DIFFERENCES << " allowed)" << std::endl;
+    return large <= MAX_LARGE_DIFFERENCES;
+  }
+}
+
+
+int main(int argc, char** argv) {
+  bool ok = true;
+
+  // The SIMD code is chosen at compile time, so this checks whichever
+  // version this compiler picked: SSE2, NEON, or the scalar fallback
+  const int SPRITES = 100000;
+  int sprite_mismatches = CheckSpriteExpansion(SPRITES);
+  std::cout << "sprite expansion: " << sprite_mismatches << " of " << SPRITES
+            << " random sprites differ from the scalar version" << std::endl;
+  if (sprite_mismatches != 0) { ok = false; }
+
+  const int ROWS = 100000;
+  int blend_mismatches = CheckGlyphBlending(ROWS);
+  std::cout << "glyph blending: " << blend_mismatches << " of " << ROWS
+            << " random rows differ from the scalar version" << std::endl;
+  if (blend_mismatches != 0) { ok = false; }
+
+  if (SDL_Init(SDL_INIT_VIDEO) < 0) { FAIL("SDL_Init"); }
+  SDL_Window* window = SDL_CreateWindow("check", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                        WIDTH, HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+  if (window == nullptr) { FAIL("SDL_CreateWindow"); }
+  {
+    GlContext context(window);
+    // A hidden window's own framebuffer may not have any pixels to
+    // read back, so the layer draws into a framebuffer object
+    GLuint framebuffer, renderbuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(1, &renderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WIDTH, HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      FAIL("glCheckFramebufferStatus");
+    }
+    glViewport(0, 0, WIDTH, HEIGHT);
+    glClearColor(1.0, 1.0, 1.0, 1.0);
+
+    if (!CompareInstancing(window, false)) { ok = false; }
+    if (!CompareInstancing(window, true)) { ok = false; }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &renderbuffer);
+    glDeleteFramebuffers(1, &framebuffer);
+  }
+  SDL_DestroyWindow(window);
+  SDL_Quit();
+
+  return ok? EXIT_SUCCESS : EXIT_FAILURE;
+}
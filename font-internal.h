@@ -0,0 +1,22 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+/** The parts of Font that check.cpp tests directly. Only font.cpp and
+ * check.cpp should include this. */
+
+#ifndef FONT_INTERNAL_H
+#define FONT_INTERNAL_H
+
+#include <cstdint>
+
+// Blend n pixels of one color into a row of 32-bit pixels, scaling
+// the color's alpha by each pixel's coverage. The color is in the
+// destination's format. BlendRow uses SIMD when the compiler targets
+// SSE2, NEON or wasm simd128, and has to give the same bytes as
+// BlendRowScalar.
+void BlendRowScalar(uint8_t* dest, const uint8_t* coverage, int n,
+                    const uint8_t color[4], int alpha);
+void BlendRow(uint8_t* dest, const uint8_t* coverage, int n,
+              const uint8_t color[4], int alpha);
+
+#endif
@@ -2,149 +2,686 @@
 // License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
 
 #include "font.h"
+#include "font-internal.h"
 #include "common.h"
 
 #include <SDL.h>
 
-#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
 #define STB_TRUETYPE_IMPLEMENTATION
 #include <stb/stb_truetype.h>
 
-// This is the ascii font range (half-open interval) I support:
-const int LOW_CHAR = 32; // space
-const int HIGH_CHAR = 126+1; // tilde
+// Kerning between these ascii characters (half-open interval) is
+// looked up once, when the font is loaded
+const uint32_t LOW_CHAR = 32; // space
+const uint32_t HIGH_CHAR = 126+1; // tilde
+const int NUM_CHARS = HIGH_CHAR - LOW_CHAR;
 
-// How many pixels to leave around each sprite
+// How many pixels to leave around each glyph
 const int PADDING = 4;
 
+// Signed distance fields have the glyph's edge at this value, and
+// go down to 0 at the spread outside it, and up to 255 inside
+const unsigned char SDF_ON_EDGE = 128;
+
+// How many layouts to keep before starting over
+const size_t MAX_LAYOUTS = 1024;
+
+// Glyphs are rasterized the first time they're drawn, into cells of
+// a grid. The grid starts with room for ascii and doubles until it
+// reaches the maximum size, and then the least recently drawn glyphs
+// give up their cells.
+const int INITIAL_COLUMNS = 16;
+const int INITIAL_ROWS = 8;
+const int MAX_ATLAS_SIZE = 2048;
+
+// Pinned glyphs can't give up their cells, so when they fill the
+// atlas it grows past the usual maximum, up to this
+const int MAX_PINNED_ATLAS_SIZE = 4096;
+
+// How many changed cells to remember for copying to textures; anyone
+// further behind copies the whole atlas
+const size_t MAX_CHANGES = 256;
+
+// Drawn for bytes that aren't valid UTF-8
+const uint32_t REPLACEMENT_CHARACTER = 0xfffd;
+
+struct Glyph {
+  int index;            // in the font, for kerning
+  int x0, y0, x1, y1;   // bitmap box, relative to the pen on the baseline
+  float xadvance;
+  bool cached;          // has a cell in the atlas
+  int pinned;           // the pin generation it was last used in
+  SDL_Point cell;       // top left of the cell
+  std::list<uint32_t>::iterator lru;
+};
+
+struct AtlasChange {
+  int version;          // of the atlas after the change
+  SDL_Rect rect;
+};
+
+struct FontFaceImpl {
+  stbtt_fontinfo info; // points into the data
+  void* data;
+  size_t size;
+  std::vector<char> buffer; // without mmap
+};
+
 struct FontImpl {
-  stbtt_fontinfo font;
-  SDL_Surface *surface;
-  int height;
+  std::shared_ptr<FontFace> face;
+  const stbtt_fontinfo* font;
+  float scale;
+  float xadvance_adjust;
+  int sdf_spread; // 0 for a bitmap font
+  // One byte of coverage, or distance, per pixel; the color is
+  // applied when the glyphs are drawn
+  std::vector<Uint8> atlas;
   int atlas_width;
   int atlas_height;
-  std::vector<unsigned char> rendered_font;
-  std::vector<stbtt_packedchar> chardata; // metrics
+  int height;
+  int cell_width;
+  int cell_height;
+  int atlas_version; // changes whenever the atlas pixels change
+  int evictions;
+
+  // The cells changed after history_start, oldest first
+  std::vector<AtlasChange> changes;
+  int history_start;
+
+  // While pinning, glyphs used in this generation can't be evicted
+  bool pinning;
+  int pin_generation;
+
+  // Metrics are kept for every codepoint used; only the cached
+  // glyphs use the atlas, most recently drawn first
+  std::unordered_map<uint32_t, Glyph> glyphs;
+  std::list<uint32_t> lru;
+  std::vector<SDL_Point> free_cells;
+
+  // Kerning between pairs of ascii characters, already scaled
+  std::vector<float> kerning;
+  std::unordered_map<std::string, TextLayout> layouts;
+
+  Glyph& GetGlyph(uint32_t codepoint);
+  bool Rasterize(uint32_t codepoint, Glyph& glyph);
+  bool AllocateCell(SDL_Point& cell);
+  bool Grow(int max_size);
+  void AddFreeCells(int x0, int y0, int x1, int y1);
+  void LayOut(const char* text, TextLayout& layout);
 };
 
 
-Font::Font(const char* filename, float pixelsize_, float xadvance_adjust)
-    : pixelsize(pixelsize_), self(new FontImpl) {
-  // Load the font into memory
-  std::vector<char> font_buffer;
-  std::ifstream in(filename, std::ifstream::binary);
-  in.seekg(0, std::ios_base::end);
-  font_buffer.resize(in.tellg());
-  in.seekg(0, std::ios_base::beg);
-  in.read(font_buffer.data(), font_buffer.size());
+namespace {
+  /** Decode one codepoint and move past it. Invalid bytes come out as
+   * the replacement character, one at a time. */
+  uint32_t NextCodepoint(const char*& text) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(text);
+    uint32_t c = s[0];
+    int n;
+    if (c < 0x80) { text += 1; return c; }
+    else if ((c & 0xe0) == 0xc0) { n = 1; c &= 0x1f; }
+    else if ((c & 0xf0) == 0xe0) { n = 2; c &= 0x0f; }
+    else if ((c & 0xf8) == 0xf0) { n = 3; c &= 0x07; }
+    else { text += 1; return REPLACEMENT_CHARACTER; }
+    for (int i = 1; i <= n; i++) {
+      // This also stops at the terminating '\0'
+      if ((s[i] & 0xc0) != 0x80) { text += i; return REPLACEMENT_CHARACTER; }
+      c = (c << 6) | (s[i] & 0x3f);
+    }
+    text += n + 1;
+    return c <= 0x10ffff? c : REPLACEMENT_CHARACTER;
+  }
+}
 
-  // Use font metrics to determine how big I need to make the bitmap
 
-  self->atlas_width = 0;
-  self->height = int(ceil(pixelsize));
-  self->atlas_height = self->height + 2 * PADDING;
-  stbtt_InitFont(&self->font, reinterpret_cast<unsigned char*>(font_buffer.data()), 0);
-  const float scale = stbtt_ScaleForPixelHeight(&self->font, pixelsize);
-  for (char c = LOW_CHAR; c < HIGH_CHAR; c++) {
-    int ix0, iy0, ix1, iy1;
-    stbtt_GetCodepointBitmapBox(&self->font, c, scale, scale,
-                                &ix0, &iy0, &ix1, &iy1);
-    self->atlas_width += ix1 - ix0 + 2 * PADDING;
-  }
-
-  // Render the font into the bitmap
-  std::vector<unsigned char> rendered_font_grayscale;
-  rendered_font_grayscale.resize(self->atlas_width * self->atlas_height);
-
-  const int N = HIGH_CHAR - LOW_CHAR;
-  self->chardata.resize(HIGH_CHAR - LOW_CHAR);
-  stbtt_pack_context context;
-  stbtt_PackBegin(&context, rendered_font_grayscale.data(),
-                  self->atlas_width, self->atlas_height, 0, PADDING, nullptr);
-  int r = stbtt_PackFontRange(&context,
-                              reinterpret_cast<unsigned char*>(font_buffer.data()),
-                              0, pixelsize, LOW_CHAR, N, self->chardata.data());
-  if (r == 0) { FAIL("Font unable to fit on texture"); }
-  stbtt_PackEnd(&context);
-
-  // Copy the grayscale bitmap into RGBA, for SDL
-  self->rendered_font.resize(self->atlas_width * self->atlas_height * 4);
-  for (unsigned i = 0; i < rendered_font_grayscale.size(); i++) {
-    self->rendered_font[i*4    ] = 255;
-    self->rendered_font[i*4 + 1] = 255;
-    self->rendered_font[i*4 + 2] = 255;
-    self->rendered_font[i*4 + 3] = rendered_font_grayscale[i];
-  }
-
-  self->surface = SDL_CreateRGBSurfaceFrom(self->rendered_font.data(),
-                                           self->atlas_width, self->atlas_height,
-                                           32, self->atlas_width*4,
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-                                           0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff
+/** Map the file instead of reading it, so that only the tables that
+ * are used get read, and all the fonts made from it share them.
+ */
+FontFace::FontFace(const char* filename): self(new FontFaceImpl) {
+  self->data = nullptr;
+  self->size = 0;
+#ifdef HAVE_MMAP
+  int fd = open(filename, O_RDONLY);
+  if (fd >= 0) {
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        self->data = data;
+        self->size = info.st_size;
+      }
+    }
+    close(fd);
+  }
 #else
-                                           0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000
+  SDL_RWops* file = SDL_RWFromFile(filename, "rb");
+  if (file != nullptr) {
+    self->buffer.resize(SDL_RWsize(file));
+    if (!self->buffer.empty()
+        && SDL_RWread(file, self->buffer.data(), self->buffer.size(), 1) == 1) {
+      self->data = self->buffer.data();
+      self->size = self->buffer.size();
+    }
+    SDL_RWclose(file);
+  }
 #endif
-  );
+  if (self->data == nullptr
+      || !stbtt_InitFont(&self->info, static_cast<const unsigned char*>(self->data), 0)) {
+    std::cerr << filename << ": ";
+    FAIL("Unable to load font");
+  }
+}
+
+
+FontFace::~FontFace() {
+#ifdef HAVE_MMAP
+  munmap(self->data, self->size);
+#endif
+}
+
+
+std::shared_ptr<FontFace> FontFace::Open(const char* filename) {
+  // The fonts keep their faces alive; this only remembers them
+  static std::unordered_map<std::string, std::weak_ptr<FontFace>> opened;
+  std::weak_ptr<FontFace>& entry = opened[filename];
+  std::shared_ptr<FontFace> face = entry.lock();
+  if (face == nullptr) {
+    face = std::make_shared<FontFace>(filename);
+    entry = face;
+  }
+  return face;
+}
+
+
+const stbtt_fontinfo* FontFace::Info() const {
+  return &self->info;
+}
+
+
+Font::Font(const char* filename, float pixelsize_, float xadvance_adjust, bool sdf)
+  : Font(FontFace::Open(filename), pixelsize_, xadvance_adjust, sdf) {}
+
+
+Font::Font(std::shared_ptr<FontFace> face, float pixelsize_, float xadvance_adjust, bool sdf)
+    : pixelsize(pixelsize_), self(new FontImpl) {
+  self->face = face;
+  self->font = face->Info();
+
+  // Use the font's bounding box to determine how big a cell has to
+  // be to hold any of its glyphs. A distance field needs room for the
+  // distances outside the glyph too; an eighth of the size is enough
+  // for an outline or glow.
+  self->height = int(ceil(pixelsize));
+  self->scale = stbtt_ScaleForPixelHeight(self->font, pixelsize);
+  self->xadvance_adjust = xadvance_adjust;
+  self->sdf_spread = sdf? std::max(2, int(ceil(pixelsize / 8))) : 0;
+  int x0, y0, x1, y1;
+  stbtt_GetFontBoundingBox(self->font, &x0, &y0, &x1, &y1);
+  self->cell_width = int(ceil(self->scale * (x1 - x0))) + 2 * self->sdf_spread + PADDING;
+  self->cell_height = int(ceil(self->scale * (y1 - y0))) + 2 * self->sdf_spread + PADDING;
+
+  int width = std::min(INITIAL_COLUMNS * self->cell_width, MAX_ATLAS_SIZE);
+  int height = std::min(INITIAL_ROWS * self->cell_height, MAX_ATLAS_SIZE);
+  if (width < self->cell_width || height < self->cell_height) {
+    FAIL("Font too big for the glyph atlas");
+  }
+  self->atlas.assign(width * height, 0);
+  self->atlas_width = width;
+  self->atlas_height = height;
+  self->atlas_version = 0;
+  self->evictions = 0;
+  self->history_start = 0;
+  self->pinning = false;
+  self->pin_generation = 0;
+  self->AddFreeCells(0, 0, width, height);
+
+  self->kerning.resize(NUM_CHARS * NUM_CHARS);
+  for (int i = 0; i < NUM_CHARS; i++) {
+    int first = self->GetGlyph(LOW_CHAR + i).index;
+    for (int j = 0; j < NUM_CHARS; j++) {
+      int second = self->GetGlyph(LOW_CHAR + j).index;
+      self->kerning[i * NUM_CHARS + j] =
+        self->scale * stbtt_GetGlyphKernAdvance(self->font, first, second);
+    }
+  }
 }
 
 
 Font::~Font() {}
 
 
-void Font::Draw(SDL_Surface *surface, int x, int y, const char* text) const {
-  const float scale = stbtt_ScaleForPixelHeight(&self->font, pixelsize);
-  float offset_x = x, offset_y = y;
-  stbtt_aligned_quad quad;
-  for (const char* s = text; *s != '\0'; s++) {
-    int char_index = *s - LOW_CHAR;
-    if (char_index < 0 || char_index >= int(self->chardata.size())) {
-      FAIL("Tried to render character out of range");
+/** Look up the metrics for a codepoint, the first time it's used.
+ * Codepoints the font doesn't have get its missing glyph. */
+Glyph& FontImpl::GetGlyph(uint32_t codepoint) {
+  auto found = glyphs.find(codepoint);
+  if (found != glyphs.end()) { return found->second; }
+
+  Glyph& glyph = glyphs[codepoint];
+  glyph.index = stbtt_FindGlyphIndex(font, codepoint);
+  stbtt_GetGlyphBitmapBox(font, glyph.index, scale, scale,
+                          &glyph.x0, &glyph.y0, &glyph.x1, &glyph.y1);
+  if (sdf_spread > 0 && glyph.x1 > glyph.x0 && glyph.y1 > glyph.y0) {
+    glyph.x0 -= sdf_spread; glyph.y0 -= sdf_spread;
+    glyph.x1 += sdf_spread; glyph.y1 += sdf_spread;
+  }
+  int advance, left_side_bearing;
+  stbtt_GetGlyphHMetrics(font, glyph.index, &advance, &left_side_bearing);
+  glyph.xadvance = scale * advance + xadvance_adjust;
+  glyph.cached = false;
+  glyph.pinned = -1;
+  return glyph;
+}
+
+
+/** Make sure the glyph is in the atlas, and mark it as the most
+ * recently used. Returns false if there's no room even after
+ * growing, because all the glyphs are pinned. */
+bool FontImpl::Rasterize(uint32_t codepoint, Glyph& glyph) {
+  if (pinning) { glyph.pinned = pin_generation; }
+  if (glyph.cached) {
+    lru.splice(lru.begin(), lru, glyph.lru);
+    return true;
+  }
+
+  if (!AllocateCell(glyph.cell)) { return false; }
+  glyph.cached = true;
+  atlas_version++;
+  lru.push_front(codepoint);
+  glyph.lru = lru.begin();
+
+  changes.push_back(AtlasChange{atlas_version,
+        SDL_Rect{glyph.cell.x, glyph.cell.y, cell_width, cell_height}});
+  if (changes.size() > MAX_CHANGES) {
+    history_start = changes[MAX_CHANGES / 2 - 1].version;
+    changes.erase(changes.begin(), changes.begin() + MAX_CHANGES / 2);
+  }
+
+  // The whole cell is cleared, so that nothing of the glyph that had
+  // it before shows up when the texture is filtered
+  Uint8* cell = &atlas[glyph.cell.y * atlas_width + glyph.cell.x];
+  for (int y = 0; y < cell_height; y++) {
+    std::fill(cell + y * atlas_width, cell + y * atlas_width + cell_width, 0);
+  }
+
+  int w = std::min(glyph.x1 - glyph.x0, cell_width - PADDING);
+  int h = std::min(glyph.y1 - glyph.y0, cell_height - PADDING);
+  if (sdf_spread > 0) {
+    int sdf_w, sdf_h, xoff, yoff;
+    unsigned char* sdf = stbtt_GetGlyphSDF(font, scale, glyph.index, sdf_spread, SDF_ON_EDGE,
+                                           float(SDF_ON_EDGE) / sdf_spread,
+                                           &sdf_w, &sdf_h, &xoff, &yoff);
+    if (sdf != nullptr) {
+      for (int y = 0; y < std::min(h, sdf_h); y++) {
+        std::copy(sdf + y * sdf_w, sdf + y * sdf_w + std::min(w, sdf_w), cell + y * atlas_width);
+      }
+      stbtt_FreeSDF(sdf, nullptr);
+    }
+  } else {
+    stbtt_MakeGlyphBitmap(font, cell, w, h, atlas_width, scale, scale, glyph.index);
+  }
+  return true;
+}
+
+
+bool FontImpl::AllocateCell(SDL_Point& cell) {
+  if (free_cells.empty() && !Grow(MAX_ATLAS_SIZE)) {
+    // The atlas is full, so the least recently drawn glyph has to go.
+    // Pinned glyphs are the most recently drawn, so if that one's
+    // pinned, they all are.
+    Glyph& evicted = glyphs.at(lru.back());
+    if (pinning && evicted.pinned == pin_generation) {
+      if (!Grow(MAX_PINNED_ATLAS_SIZE)) { return false; }
+    } else {
+      evicted.cached = false;
+      lru.pop_back();
+      free_cells.push_back(evicted.cell);
+      evictions++;
     }
-    stbtt_GetPackedQuad(self->chardata.data(), self->atlas_width, self->atlas_height,
-                        char_index, &offset_x, &offset_y, &quad,
-                        0);
-
-    SDL_Rect src;
-    src.x = int(round(quad.s0 * self->atlas_width));
-    src.y = int(round(quad.t0 * self->atlas_height));
-    src.w = int(round((quad.s1 - quad.s0) * self->atlas_width));
-    src.h = int(round((quad.t1 - quad.t0) * self->atlas_height));
-
-    SDL_Rect dest;
-    dest.x = int(floor(quad.x0));
-    dest.y = int(floor(quad.y0));
-    dest.w = int(ceil(quad.x1 - quad.x0));
-    dest.h = int(ceil(quad.y1 - quad.y0));
-
-    if (SDL_BlitSurface(self->surface, &src, surface, &dest) < 0) {
-      FAIL("Blit character");
+  }
+  cell = free_cells.back();
+  free_cells.pop_back();
+  return true;
+}
+
+
+/** Double the shorter side of the atlas. The cached glyphs stay where
+ * they are, and the new space becomes free cells. Returns false if
+ * the atlas is already max_size. */
+bool FontImpl::Grow(int max_size) {
+  int old_width = atlas_width, old_height = atlas_height;
+  int new_width = old_width, new_height = old_height;
+  if (new_width <= new_height && new_width * 2 <= max_size) {
+    new_width *= 2;
+  } else if (new_height * 2 <= max_size) {
+    new_height *= 2;
+  } else {
+    return false;
+  }
+
+  std::vector<Uint8> grown(new_width * new_height, 0);
+  for (int y = 0; y < old_height; y++) {
+    std::copy(&atlas[y * old_width], &atlas[y * old_width] + old_width, &grown[y * new_width]);
+  }
+  atlas.swap(grown);
+  atlas_width = new_width;
+  atlas_height = new_height;
+  atlas_version++;
+  // A texture of the old size can't be updated a cell at a time
+  changes.clear();
+  history_start = atlas_version;
+  AddFreeCells(old_width, 0, new_width, old_height);
+  AddFreeCells(0, old_height, new_width, new_height);
+  return true;
+}
+
+
+/** The cells that fit entirely in the rectangle x0,y0 to x1,y1. The
+ * cells are handed out from the back, so I put them in backwards to
+ * fill the atlas from the top left. */
+void FontImpl::AddFreeCells(int x0, int y0, int x1, int y1) {
+  for (int y = y1 - cell_height; y >= y0; y -= cell_height) {
+    for (int x = x1 - cell_width; x >= x0; x -= cell_width) {
+      free_cells.push_back(SDL_Point{x, y});
     }
+  }
+}
+
+
+/** Lay out the text from scratch. Kerning between ascii characters
+ * comes from the table; anything else asks the font. */
+void FontImpl::LayOut(const char* text, TextLayout& layout) {
+  float offset_x = 0.0;
+  uint32_t previous_codepoint = 0;
+  const Glyph* previous = nullptr;
+  for (const char* s = text; *s != '\0'; ) {
+    uint32_t codepoint = NextCodepoint(s);
+    const Glyph& glyph = GetGlyph(codepoint);
+    if (previous != nullptr) {
+      if (LOW_CHAR <= previous_codepoint && previous_codepoint < HIGH_CHAR
+          && LOW_CHAR <= codepoint && codepoint < HIGH_CHAR) {
+        offset_x += kerning[(previous_codepoint - LOW_CHAR) * NUM_CHARS + (codepoint - LOW_CHAR)];
+      } else {
+        offset_x += scale * stbtt_GetGlyphKernAdvance(font, previous->index, glyph.index);
+      }
+    }
+    previous = &glyph;
+    previous_codepoint = codepoint;
 
-    if (s[1]) {
-      offset_x += scale * stbtt_GetCodepointKernAdvance(&self->font, s[0], s[1]);
+    if (glyph.x1 > glyph.x0 && glyph.y1 > glyph.y0) {
+      GlyphQuad quad;
+      quad.x0 = offset_x + glyph.x0;
+      quad.y0 = float(glyph.y0);
+      quad.x1 = quad.x0 + std::min(glyph.x1 - glyph.x0, cell_width - PADDING);
+      quad.y1 = quad.y0 + std::min(glyph.y1 - glyph.y0, cell_height - PADDING);
+      quad.codepoint = codepoint;
+      layout.glyphs.push_back(quad);
     }
+    offset_x += glyph.xadvance;
   }
+  layout.width = offset_x;
 }
 
-int Font::Width(const char* text) const {
-  const float scale = stbtt_ScaleForPixelHeight(&self->font, pixelsize);
-  float offset_x = 0.0, offset_y = 0.0;
-  stbtt_aligned_quad quad;
-  for (const char* s = text; *s != '\0'; s++) {
-    int char_index = *s - LOW_CHAR;
-    if (char_index < 0 || char_index >= int(self->chardata.size())) {
-      FAIL("Tried to render character out of range");
+
+const TextLayout& Font::Layout(const char* text) const {
+  std::string key(text);
+  auto found = self->layouts.find(key);
+  if (found != self->layouts.end()) { return found->second; }
+
+  // Text that keeps changing, like a timer, would fill the cache with
+  // layouts that are never used again. Starting over now and then is
+  // cheaper than keeping track of which ones are still in use.
+  if (self->layouts.size() >= MAX_LAYOUTS) {
+    self->layouts.clear();
+  }
+  TextLayout& layout = self->layouts[key];
+  self->LayOut(text, layout);
+  return layout;
+}
+
+
+namespace {
+  // x / 255 rounded to nearest, for x up to 255*255, without a divide
+  inline int Div255(int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+  }
+
+  // The same, in each 16-bit lane
+#if defined(__SSE2__)
+  inline __m128i Div255(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+  }
+#elif defined(__ARM_NEON)
+  inline uint16x8_t Div255(uint16x8_t x) {
+    x = vaddq_u16(x, vdupq_n_u16(128));
+    return vshrq_n_u16(vaddq_u16(x, vshrq_n_u16(x, 8)), 8);
+  }
+#elif defined(__wasm_simd128__)
+  inline v128_t Div255(v128_t x) {
+    x = wasm_i16x8_add(x, wasm_i16x8_splat(128));
+    return wasm_u16x8_shr(wasm_i16x8_add(x, wasm_u16x8_shr(x, 8)), 8);
+  }
+#endif
+}
+
+
+/** Blend n pixels of one color into a row of 32-bit pixels, with
+ * each pixel's coverage scaling the color's alpha. This is SDL's
+ * alpha blending, done on all four bytes of each pixel, so it
+ * doesn't need to know the channel order: the color is already in
+ * the destination's format, with 255 where the alpha goes. This is
+ * the reference version; the SIMD versions below do the same
+ * integer operations, so they produce the same bytes.
+ */
+void BlendRowScalar(Uint8* dest, const Uint8* coverage, int n,
+                    const Uint8 color[4], int alpha) {
+  for (int i = 0; i < n; i++) {
+    int a = Div255(coverage[i] * alpha);
+    for (int k = 0; k < 4; k++) {
+      dest[4*i + k] = Uint8(Div255(color[k] * a + dest[4*i + k] * (255 - a)));
     }
-    stbtt_GetPackedQuad(self->chardata.data(), self->atlas_width, self->atlas_height,
-                        char_index, &offset_x, &offset_y, &quad,
-                        0);
-    if (s[1]) {
-      offset_x += scale * stbtt_GetCodepointKernAdvance(&self->font, s[0], s[1]);
+  }
+}
+
+// The SIMD versions do four pixels at a time, in 16-bit lanes; the
+// products are at most 255*255, so they fit. The pixels left over
+// at the end of the row go through the scalar version.
+#if defined(__SSE2__)
+void BlendRow(Uint8* dest, const Uint8* coverage, int n, const Uint8 color[4], int alpha) {
+  Uint32 color32;
+  memcpy(&color32, color, 4);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i C = _mm_unpacklo_epi8(_mm_set1_epi32(int(color32)), zero);
+  const __m128i full = _mm_set1_epi16(255);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    Uint32 coverage4;
+    memcpy(&coverage4, coverage + i, 4);
+    __m128i A = _mm_unpacklo_epi8(_mm_cvtsi32_si128(int(coverage4)), zero);
+    A = Div255(_mm_mullo_epi16(A, _mm_set1_epi16(short(alpha))));
+    A = _mm_unpacklo_epi16(A, A);                      // a0 a0 a1 a1 a2 a2 a3 a3
+    __m128i A_lo = _mm_unpacklo_epi32(A, A);           // a0 x4, a1 x4
+    __m128i A_hi = _mm_unpackhi_epi32(A, A);           // a2 x4, a3 x4
+    __m128i D = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + 4*i));
+    __m128i D_lo = _mm_unpacklo_epi8(D, zero), D_hi = _mm_unpackhi_epi8(D, zero);
+    D_lo = Div255(_mm_add_epi16(_mm_mullo_epi16(C, A_lo),
+                                _mm_mullo_epi16(D_lo, _mm_sub_epi16(full, A_lo))));
+    D_hi = Div255(_mm_add_epi16(_mm_mullo_epi16(C, A_hi),
+                                _mm_mullo_epi16(D_hi, _mm_sub_epi16(full, A_hi))));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4*i), _mm_packus_epi16(D_lo, D_hi));
+  }
+  BlendRowScalar(dest + 4*i, coverage + i, n - i, color, alpha);
+}
+#elif defined(__ARM_NEON)
+void BlendRow(Uint8* dest, const Uint8* coverage, int n, const Uint8 color[4], int alpha) {
+  Uint32 color32;
+  memcpy(&color32, color, 4);
+  const uint16x8_t C = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(color32)));
+  const uint16x8_t full = vdupq_n_u16(255);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    Uint32 coverage4;
+    memcpy(&coverage4, coverage + i, 4);
+    uint16x8_t A = vmovl_u8(vcreate_u8(coverage4));
+    A = Div255(vmulq_n_u16(A, Uint16(alpha)));
+    uint16x4x2_t A2 = vzip_u16(vget_low_u16(A), vget_low_u16(A));  // a0 a0 a1 a1, a2 a2 a3 a3
+    uint16x4x2_t A01 = vzip_u16(A2.val[0], A2.val[0]);
+    uint16x4x2_t A23 = vzip_u16(A2.val[1], A2.val[1]);
+    uint16x8_t A_lo = vcombine_u16(A01.val[0], A01.val[1]);         // a0 x4, a1 x4
+    uint16x8_t A_hi = vcombine_u16(A23.val[0], A23.val[1]);         // a2 x4, a3 x4
+    uint8x16_t D = vld1q_u8(dest + 4*i);
+    uint16x8_t D_lo = vmovl_u8(vget_low_u8(D)), D_hi = vmovl_u8(vget_high_u8(D));
+    D_lo = Div255(vmlaq_u16(vmulq_u16(C, A_lo), D_lo, vsubq_u16(full, A_lo)));
+    D_hi = Div255(vmlaq_u16(vmulq_u16(C, A_hi), D_hi, vsubq_u16(full, A_hi)));
+    vst1q_u8(dest + 4*i, vcombine_u8(vmovn_u16(D_lo), vmovn_u16(D_hi)));
+  }
+  BlendRowScalar(dest + 4*i, coverage + i, n - i, color, alpha);
+}
+#elif defined(__wasm_simd128__)
+void BlendRow(Uint8* dest, const Uint8* coverage, int n, const Uint8 color[4], int alpha) {
+  Uint32 color32;
+  memcpy(&color32, color, 4);
+  const v128_t C = wasm_u16x8_extend_low_u8x16(wasm_i32x4_splat(int(color32)));
+  const v128_t full = wasm_i16x8_splat(255);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    v128_t A = wasm_u16x8_extend_low_u8x16(wasm_v128_load32_zero(coverage + i));
+    A = Div255(wasm_i16x8_mul(A, wasm_i16x8_splat(short(alpha))));
+    v128_t A_lo = wasm_i16x8_shuffle(A, A, 0, 0, 0, 0, 1, 1, 1, 1);
+    v128_t A_hi = wasm_i16x8_shuffle(A, A, 2, 2, 2, 2, 3, 3, 3, 3);
+    v128_t D = wasm_v128_load(dest + 4*i);
+    v128_t D_lo = wasm_u16x8_extend_low_u8x16(D), D_hi = wasm_u16x8_extend_high_u8x16(D);
+    D_lo = Div255(wasm_i16x8_add(wasm_i16x8_mul(C, A_lo),
+                                 wasm_i16x8_mul(D_lo, wasm_i16x8_sub(full, A_lo))));
+    D_hi = Div255(wasm_i16x8_add(wasm_i16x8_mul(C, A_hi),
+                                 wasm_i16x8_mul(D_hi, wasm_i16x8_sub(full, A_hi))));
+    wasm_v128_store(dest + 4*i, wasm_u8x16_narrow_i16x8(D_lo, D_hi));
+  }
+  BlendRowScalar(dest + 4*i, coverage + i, n - i, color, alpha);
+}
+#else
+void BlendRow(Uint8* dest, const Uint8* coverage, int n, const Uint8 color[4], int alpha) {
+  BlendRowScalar(dest, coverage, n, color, alpha);
+}
+#endif
+
+
+void Font::Draw(SDL_Surface *surface, int x, int y, const char* text) const {
+  Draw(surface, x, y, text, SDL_Color{255, 255, 255, 255});
+}
+
+
+void Font::Draw(SDL_Surface *surface, int x, int y, const char* text,
+                const SDL_Color& color) const {
+  if (self->sdf_spread > 0) { FAIL("Font::Draw needs a bitmap font, not a distance field"); }
+  if (surface->format->BytesPerPixel != 4) { FAIL("Font::Draw needs a 32-bit surface"); }
+  Uint32 pixel = SDL_MapRGBA(surface->format, color.r, color.g, color.b, 255);
+  Uint8 pixel_bytes[4];
+  memcpy(pixel_bytes, &pixel, 4);
+
+  if (SDL_MUSTLOCK(surface)) { SDL_LockSurface(surface); }
+  const SDL_Rect& clip = surface->clip_rect;
+  for (const GlyphQuad& quad : Layout(text).glyphs) {
+    SDL_Rect src = GlyphRect(quad.codepoint);
+    int dest_x = x + int(floor(quad.x0));
+    int dest_y = y + int(quad.y0);
+
+    // Only the part of the glyph inside the clip rect is drawn, like
+    // SDL_BlitSurface
+    int x0 = std::max(dest_x, clip.x), x1 = std::min(dest_x + src.w, clip.x + clip.w);
+    int y0 = std::max(dest_y, clip.y), y1 = std::min(dest_y + src.h, clip.y + clip.h);
+    for (int dy = y0; dy < y1; dy++) {
+      const Uint8* coverage = &self->atlas[(src.y + dy - dest_y) * self->atlas_width
+                                           + src.x + x0 - dest_x];
+      Uint8* row = static_cast<Uint8*>(surface->pixels) + dy * surface->pitch + x0 * 4;
+      BlendRow(row, coverage, x1 - x0, pixel_bytes, color.a);
     }
   }
-  return int(ceil(offset_x));
+  if (SDL_MUSTLOCK(surface)) { SDL_UnlockSurface(surface); }
+}
+
+SDL_Rect Font::GlyphRect(uint32_t codepoint) const {
+  Glyph& glyph = self->GetGlyph(codepoint);
+  SDL_Rect rect = {0, 0, 0, 0};
+  if (glyph.x1 > glyph.x0 && glyph.y1 > glyph.y0 && self->Rasterize(codepoint, glyph)) {
+    rect.x = glyph.cell.x;
+    rect.y = glyph.cell.y;
+    rect.w = std::min(glyph.x1 - glyph.x0, self->cell_width - PADDING);
+    rect.h = std::min(glyph.y1 - glyph.y0, self->cell_height - PADDING);
+  }
+  return rect;
+}
+
+const uint8_t* Font::AtlasPixels() const {
+  return self->atlas.data();
+}
+
+int Font::AtlasWidth() const {
+  return self->atlas_width;
+}
+
+int Font::AtlasHeight() const {
+  return self->atlas_height;
+}
+
+int Font::AtlasVersion() const {
+  return self->atlas_version;
+}
+
+int Font::Evictions() const {
+  return self->evictions;
+}
+
+bool Font::ChangedRects(int since_version, std::vector<SDL_Rect>& rects) const {
+  rects.clear();
+  if (since_version < self->history_start) { return false; }
+  for (const AtlasChange& change : self->changes) {
+    if (change.version > since_version) { rects.push_back(change.rect); }
+  }
+  return true;
+}
+
+void Font::PinGlyphs() const {
+  self->pinning = true;
+  self->pin_generation++;
+}
+
+void Font::UnpinGlyphs() const {
+  self->pinning = false;
+}
+
+int Font::SDFSpread() const {
+  return self->sdf_spread;
+}
+
+int Font::Width(const char* text) const {
+  return int(ceil(Layout(text).width));
 }
 
 int Font::Height() const {
@@ -152,8 +689,7 @@ int Font::Height() const {
 }
 
 int Font::Baseline() const {
-  const float scale = stbtt_ScaleForPixelHeight(&self->font, pixelsize);
   int x0, y0, x1, y1;
-  stbtt_GetFontBoundingBox(&self->font, &x0, &y0, &x1, &y1);
-  return int(pixelsize + ceil(scale * y0));
+  stbtt_GetFontBoundingBox(self->font, &x0, &y0, &x1, &y1);
+  return int(pixelsize + ceil(self->scale * y0));
 }
@@ -6,22 +6,105 @@
 #ifndef FONT_H
 #define FONT_H
 
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 struct SDL_Surface;
+struct SDL_Rect;
+struct SDL_Color;
+struct stbtt_fontinfo;
+struct FontFaceImpl;
 struct FontImpl;
 
+// A font file, mapped into memory once and shared by every Font made
+// from it, at any size. Metrics and glyphs are read from it as
+// they're needed.
+class FontFace {
+public:
+  FontFace(const char* filename);
+  ~FontFace();
+
+  // The face already open for this file, or a new one
+  static std::shared_ptr<FontFace> Open(const char* filename);
+
+  const stbtt_fontinfo* Info() const;
+
+private:
+  std::unique_ptr<FontFaceImpl> self;
+};
+
+// One glyph of laid out text, in pixels relative to the start of the
+// baseline
+struct GlyphQuad {
+  float x0, y0, x1, y1;
+  uint32_t codepoint;
+};
+
+struct TextLayout {
+  std::vector<GlyphQuad> glyphs; // only the ones with pixels to draw
+  float width;
+};
+
 class Font {
 public:
   // The font will be ceil(pixelsize) pixels high. Use xadvance_adjust to
-  // increase or decrease spacing between characters.
-  Font(const char* filename, float pixelsize, float xadvance_adjust=0.0);
+  // increase or decrease spacing between characters. With sdf, the
+  // atlas has signed distance fields instead of bitmaps. They can only
+  // be drawn with RenderText, but one font can then be drawn sharply
+  // at any scale, with an outline or glow.
+  // Fonts from the same file share its FontFace.
+  Font(const char* filename, float pixelsize, float xadvance_adjust=0.0, bool sdf=false);
+  Font(std::shared_ptr<FontFace> face, float pixelsize, float xadvance_adjust=0.0,
+       bool sdf=false);
   ~Font();
 
-  // Draw text at x,y being the baseline. Drawing can happen both
+  // Draw UTF-8 text at x,y being the baseline. Drawing can happen both
   // above and below the baseline. For example, a font with pixelsize=30
   // and y=100 might draw starting from y=80 and ending at y=120.
+  // Glyphs are rasterized the first time they're drawn, and the least
+  // recently drawn ones are dropped if there are too many to keep.
+  // The glyphs are blended in the color, white by default; the surface
+  // has to have 32-bit pixels.
   void Draw(SDL_Surface* surface, int x, int y, const char* text) const;
+  void Draw(SDL_Surface* surface, int x, int y, const char* text,
+            const SDL_Color& color) const;
+
+  // Where each glyph goes. Layouts are cached by text, so measuring
+  // and then drawing the same text only lays it out once. The layout
+  // is valid until the next call.
+  const TextLayout& Layout(const char* text) const;
+
+  // For drawing glyphs from a texture instead of with Draw. GlyphRect
+  // rasterizes the glyph if it isn't in the atlas, and returns where
+  // it is. The version changes whenever the atlas pixels change,
+  // including when the atlas grows. A glyph stays where it is until
+  // more glyphs are drawn than fit in the atlas, and one is evicted
+  // to make room. The atlas has one byte per pixel, to be used as
+  // alpha (GL_ALPHA), and its rows are AtlasWidth bytes apart.
+  SDL_Rect GlyphRect(uint32_t codepoint) const;
+  const uint8_t* AtlasPixels() const;
+  int AtlasWidth() const;
+  int AtlasHeight() const;
+  int AtlasVersion() const;
+  int Evictions() const;
+
+  // The cells that changed after an atlas version, to be copied to a
+  // texture. Returns false if the whole atlas has to be copied, such
+  // as after it grows.
+  bool ChangedRects(int since_version, std::vector<SDL_Rect>& rects) const;
+
+  // Glyphs used between these aren't evicted by each other, so that
+  // the rects from GlyphRect all stay valid together. If they don't
+  // fit, the atlas grows past its usual maximum, and if they still
+  // don't fit, GlyphRect returns empty rects.
+  void PinGlyphs() const;
+  void UnpinGlyphs() const;
+
+  // How many pixels the distance field reaches outside the glyphs,
+  // and inside. 0 for a bitmap font. The atlas value for a distance
+  // d (positive inside) is 128 + d * 128 / spread, clamped to 0-255.
+  int SDFSpread() const;
 
   int Height() const;
   int Baseline() const;
@@ -4,6 +4,12 @@
 #include "glwrappers.h"
 #include "common.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
 
 void GLERRORS(const char* label) {
 #ifndef __EMSCRIPTEN__
@@ -15,6 +21,50 @@ void GLERRORS(const char* label) {
 #endif
 }
 
+bool HasGLExtension(const char* name) {
+  const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+  if (extensions == nullptr) { return false; }
+  // The extension string is space separated, and some names are
+  // prefixes of others, so match whole words only
+  size_t length = strlen(name);
+  for (const char* s = strstr(extensions, name); s != nullptr; s = strstr(s + 1, name)) {
+    bool starts_word = s == extensions || s[-1] == ' ';
+    bool ends_word = s[length] == ' ' || s[length] == '\0';
+    if (starts_word && ends_word) { return true; }
+  }
+  return false;
+}
+
+InstancedArrays::InstancedArrays(): VertexAttribDivisor(nullptr), DrawArraysInstanced(nullptr) {
+  // The version string is "major.minor ..." on desktop and "OpenGL ES
+  // major.minor ..." on GLES and WebGL
+  const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  if (version == nullptr) { return; }
+  bool es = strstr(version, "OpenGL ES") != nullptr;
+  int major = 0, minor = 0;
+  const char* digits = strpbrk(version, "0123456789");
+  if (digits != nullptr) { sscanf(digits, "%d.%d", &major, &minor); }
+
+  std::string suffix;
+  if (es? major >= 3 : major * 10 + minor >= 33) {
+    suffix = "";
+  } else if (HasGLExtension("GL_ARB_instanced_arrays") && HasGLExtension("GL_ARB_draw_instanced")) {
+    suffix = "ARB";
+  } else if (HasGLExtension("GL_ANGLE_instanced_arrays")) {
+    suffix = "ANGLE";
+  } else {
+    return;
+  }
+  VertexAttribDivisor = reinterpret_cast<decltype(VertexAttribDivisor)>
+    (SDL_GL_GetProcAddress(("glVertexAttribDivisor" + suffix).c_str()));
+  DrawArraysInstanced = reinterpret_cast<decltype(DrawArraysInstanced)>
+    (SDL_GL_GetProcAddress(("glDrawArraysInstanced" + suffix).c_str()));
+  if (!Available()) {
+    VertexAttribDivisor = nullptr;
+    DrawArraysInstanced = nullptr;
+  }
+}
+
 void FAIL(const char* label) {
   GLERRORS(label);
   std::cerr << label << " failed : " << SDL_GetError() << std::endl;
@@ -98,7 +148,9 @@ void ShaderProgram::AttachShader(GLenum type, const GLchar* source) {
 }
 
 
-Texture::Texture(SDL_Surface* surface) {
+Texture::Texture(SDL_Surface* surface, TextureFormat format_, bool dither_)
+  :format(format_), dither(dither_)
+{
   glGenTextures(1, &id);
   if (surface != nullptr) {
     CopyFromSurface(surface);
@@ -106,7 +158,7 @@ Texture::Texture(SDL_Surface* surface) {
 }
 
 void Texture::CopyFromPixels(int width, int height,
-                             GLenum format, void* pixels)
+                             GLenum pixel_format, void* pixels, GLenum type)
 {
   glBindTexture(GL_TEXTURE_2D, id);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -116,17 +168,151 @@ void Texture::CopyFromPixels(int width, int height,
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+  // GLES and WebGL need the internal format to match the format.
+  // Rows of 16-bit or 8-bit pixels aren't always 4-byte aligned.
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, pixel_format, width, height, 0, pixel_format, type, pixels);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
   GLERRORS("Texture creation");
 }
 
 
+static GLenum SurfaceFormat(SDL_Surface* surface) {
+  return surface->format->BytesPerPixel == 1? GL_ALPHA
+    : surface->format->BytesPerPixel == 3? GL_RGB
+    : GL_RGBA /* TODO: check for other formats */;
+}
+
+
+namespace {
+  // 4x4 Bayer matrix for ordered dithering
+  const int BAYER[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5},
+  };
+
+  GLenum GLFormat(TextureFormat format) {
+    switch (format) {
+    case TextureFormat::RGB565: return GL_RGB;
+    case TextureFormat::A8: return GL_ALPHA;
+    default: return GL_RGBA;
+    }
+  }
+
+  GLenum GLType(TextureFormat format) {
+    switch (format) {
+    case TextureFormat::RGBA4444: return GL_UNSIGNED_SHORT_4_4_4_4;
+    case TextureFormat::RGB565: return GL_UNSIGNED_SHORT_5_6_5;
+    default: return GL_UNSIGNED_BYTE;
+    }
+  }
+
+  /** Convert part of an RGBA surface into tightly packed pixels of a
+   * smaller format. The dither pattern is based on the position in
+   * the whole surface, so that converting a rect gives the same
+   * pixels as converting everything.
+   */
+  std::vector<Uint8> ConvertPixels(SDL_Surface* surface, const SDL_Rect& rect,
+                                   TextureFormat format, bool dither) {
+    SDL_Surface* rgba = surface;
+    if (surface->format->format != SDL_PIXELFORMAT_RGBA32) {
+      rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+      if (rgba == nullptr) { FAIL("SDL_ConvertSurfaceFormat"); }
+    }
+    
+    int bytes_per_pixel = format == TextureFormat::A8? 1 : 2;
+    std::vector<Uint8> converted(rect.w * rect.h * bytes_per_pixel);
+    for (int y = 0; y < rect.h; y++) {
+      const Uint8* row = static_cast<const Uint8*>(rgba->pixels)
+        + (rect.y + y) * rgba->pitch + rect.x * 4;
+      for (int x = 0; x < rect.w; x++) {
+        const Uint8* rgba_pixel = row + 4 * x;
+        int i = y * rect.w + x;
+        // Rounding is the same as a threshold halfway between levels
+        int threshold = dither? (2 * BAYER[(rect.y + y) & 3][(rect.x + x) & 3] + 1) * 255 / 32 : 127;
+        auto quantize = [&](int channel, int bits) {
+          int levels = (1 << bits) - 1;
+          return std::min((rgba_pixel[channel] * levels + threshold) / 255, levels);
+        };
+        switch (format) {
+        case TextureFormat::RGBA4444: {
+          Uint16 pixel = (quantize(0, 4) << 12) | (quantize(1, 4) << 8)
+            | (quantize(2, 4) << 4) | quantize(3, 4);
+          memcpy(&converted[2 * i], &pixel, 2);
+          break;
+        }
+        case TextureFormat::RGB565: {
+          Uint16 pixel = (quantize(0, 5) << 11) | (quantize(1, 6) << 5) | quantize(2, 5);
+          memcpy(&converted[2 * i], &pixel, 2);
+          break;
+        }
+        default:
+          converted[i] = rgba_pixel[3];
+          break;
+        }
+      }
+    }
+
+    if (rgba != surface) { SDL_FreeSurface(rgba); }
+    return converted;
+  }
+}
+
+
 void Texture::CopyFromSurface(SDL_Surface* surface) {
-  CopyFromPixels(surface->w, surface->h,
-                 surface->format->BytesPerPixel == 1? GL_ALPHA
-                 : surface->format->BytesPerPixel == 3? GL_RGB
-                 : GL_RGBA /* TODO: check for other formats */,
-                 surface->pixels);
+  if (format == TextureFormat::RGBA8) {
+    CopyFromPixels(surface->w, surface->h, SurfaceFormat(surface), surface->pixels);
+  } else {
+    std::vector<Uint8> pixels = ConvertPixels(surface, SDL_Rect{0, 0, surface->w, surface->h},
+                                              format, dither);
+    CopyFromPixels(surface->w, surface->h, GLFormat(format), pixels.data(), GLType(format));
+  }
+}
+
+
+void Texture::CopyRectFromSurface(SDL_Surface* surface, const SDL_Rect& rect) {
+  CopyRectFromSurface(surface, rect, rect.x, rect.y);
+}
+
+
+void Texture::CopyRectFromSurface(SDL_Surface* surface, const SDL_Rect& rect,
+                                  int dest_x, int dest_y) {
+  if (format != TextureFormat::RGBA8) {
+    std::vector<Uint8> pixels = ConvertPixels(surface, rect, format, dither);
+    glBindTexture(GL_TEXTURE_2D, id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, dest_x, dest_y, rect.w, rect.h,
+                    GLFormat(format), GLType(format), pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GLERRORS("Texture update");
+    return;
+  }
+  
+  int bytes_per_pixel = surface->format->BytesPerPixel;
+  const Uint8* pixels = static_cast<const Uint8*>(surface->pixels)
+    + rect.y * surface->pitch + rect.x * bytes_per_pixel;
+  glBindTexture(GL_TEXTURE_2D, id);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+#ifdef __EMSCRIPTEN__
+  // WebGL 1 doesn't have GL_UNPACK_ROW_LENGTH, so I copy the rows
+  // of the rect next to each other first
+  std::vector<Uint8> rows(rect.w * rect.h * bytes_per_pixel);
+  for (int y = 0; y < rect.h; y++) {
+    memcpy(&rows[y * rect.w * bytes_per_pixel], pixels + y * surface->pitch,
+           rect.w * bytes_per_pixel);
+  }
+  glTexSubImage2D(GL_TEXTURE_2D, 0, dest_x, dest_y, rect.w, rect.h,
+                  SurfaceFormat(surface), GL_UNSIGNED_BYTE, rows.data());
+#else
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, surface->pitch / bytes_per_pixel);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, dest_x, dest_y, rect.w, rect.h,
+                  SurfaceFormat(surface), GL_UNSIGNED_BYTE, pixels);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+#endif
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  GLERRORS("Texture update");
 }
 
 Texture::~Texture() {
@@ -18,6 +18,22 @@
 // Check for any OpenGL errors and print them
 void GLERRORS(const char* label);
 
+// Check whether the current context advertises an extension, such as
+// "GL_OES_element_index_uint". Needs a current GL context.
+bool HasGLExtension(const char* name);
+
+
+// Instanced drawing isn't in OpenGL 2.1 or WebGL 1, but it's in
+// OpenGL 3.3, WebGL 2, and in extensions to the older versions. The
+// function pointers are null if none of those are available. Needs
+// a current GL context.
+struct InstancedArrays {
+  void (APIENTRY *VertexAttribDivisor)(GLuint index, GLuint divisor);
+  void (APIENTRY *DrawArraysInstanced)(GLenum mode, GLint first, GLsizei count, GLsizei instances);
+  InstancedArrays();
+  bool Available() const { return VertexAttribDivisor && DrawArraysInstanced; }
+};
+
 
 SDL_Surface* CreateRGBASurface(int width, int height);
 
@@ -32,12 +48,29 @@ private:
 };
 
 
+// How a texture stores RGBA surfaces on the GPU. The 16-bit formats
+// take half the memory and upload time; A8 keeps only the alpha, for
+// masks, and takes a quarter. Dithering hides the banding from the
+// fewer bits per channel.
+enum class TextureFormat { RGBA8, RGBA4444, RGB565, A8 };
+
+
 struct Texture: nocopy {
   GLuint id;
-  Texture(SDL_Surface* surface = nullptr);
+  TextureFormat format;
+  bool dither;
+  Texture(SDL_Surface* surface = nullptr,
+          TextureFormat format = TextureFormat::RGBA8, bool dither = false);
   ~Texture();
-  void CopyFromPixels(int width, int height, GLenum format, void* pixels);
+  void CopyFromPixels(int width, int height, GLenum format, void* pixels,
+                      GLenum type = GL_UNSIGNED_BYTE);
   void CopyFromSurface(SDL_Surface* surface);
+  // Copy only this part of the surface, to the same place in the
+  // texture, or with its corner at dest_x,dest_y. The texture has to
+  // have been created big enough, with the same format.
+  void CopyRectFromSurface(SDL_Surface* surface, const SDL_Rect& rect);
+  void CopyRectFromSurface(SDL_Surface* surface, const SDL_Rect& rect,
+                           int dest_x, int dest_y);
 };
 
 
@@ -7,11 +7,15 @@
 #include "render-sprites.h"
 #include "render-shapes.h"
 #include "render-surface.h"
+#include "render-text.h"
 #include "render-imgui.h"
 #include "font.h"
+#include "worker-pool.h"
 
 #include <SDL.h>
 
+#include <string>
+
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #endif
@@ -20,12 +24,31 @@
 #define SHOW_SHAPES 0
 #define SHOW_IMGUI 1
 #define SHOW_OVERLAY 1
+#define SHOW_TEXT 1
 
 std::unique_ptr<Window> window;
+std::unique_ptr<WorkerPool> workers;
 std::unique_ptr<RenderSprites> sprite_layer;
 std::unique_ptr<RenderShapes> shape_layer;
+std::unique_ptr<RenderText> text_layer;
+std::unique_ptr<Font> text_font;
+std::unique_ptr<Font> sdf_font;
 static bool main_loop_running = true;
 
+const int SIDE = 4; // Try changing to 100 or 1000
+std::vector<int> sprite_ids;
+
+Sprite make_sprite(int j) {
+  Sprite s;
+  s.image_id = 0;
+  s.x = (0.5f + j % SIDE - 0.5f*SIDE + ((j/SIDE)%2) * 0.5f - 0.25f) * 2.0f / SIDE;
+  s.y = (0.5f + j / SIDE - 0.5f*SIDE) * 2.0f / SIDE;
+  s.scale = 2.0f / SIDE;
+  s.rotation_degrees = 0.0f;
+  s.angular_velocity = j * 0.018f * DEG_TO_RAD;
+  return s;
+}
+
 Triangle tri(float x1, float y1, float x2, float y2, float x3, float y3) {
   return Triangle{{x1, x2, x3}, {y1, y2, y3}};
 }
@@ -49,25 +72,34 @@ void main_loop() {
   }
 
   if (window->visible) {
-    static float t = 0.0;
-    t += 0.01f;
-
 #if SHOW_SPRITES
+    // The sprites spin on their own; they only need the time
+    sprite_layer->SetTime(SDL_GetTicks() / 1000.0f);
+#endif
+
+#if SHOW_TEXT
     {
-      std::vector<Sprite> sprites;
-      int SIDE = 4; // Try changing to 100; can't have more than 128 though because I use GLushort somewhere
-      int NUM = SIDE * SIDE;
-      for (int j = 0; j < NUM; j++) {
-        sprites.emplace_back();
-        auto& s = sprites.back();
-        s.image_id = 0;
-        s.x = (0.5f + j % SIDE - 0.5f*SIDE + ((j/SIDE)%2) * 0.5f - 0.25f) * 2.0f / SIDE;
-        s.y = (0.5f + j / SIDE - 0.5f*SIDE) * 2.0f / SIDE;
-        s.scale = 2.0f / SIDE;
-        s.rotation_degrees = j * 0.03f * t * DEG_TO_RAD;
-      }
-
-      sprite_layer->SetSprites(sprites);
+      // SetLabels ignores labels that are the same as last frame's, so
+      // this text only makes new vertices once a second, and needs no
+      // texture uploads once its digits are in the font's atlas
+      Label label;
+      label.font = text_font.get();
+      label.text = "Seconds: " + std::to_string(SDL_GetTicks() / 1000);
+      label.x = 8.0f;
+      label.y = window->height - 8.0f;
+      label.r = 1.0f; label.g = 0.9f; label.b = 0.5f;
+
+      // One distance field font is sharp at any size
+      Label title;
+      title.font = sdf_font.get();
+      title.text = "Hello world";
+      title.x = 8.0f;
+      title.y = window->height - 40.0f;
+      title.scale = 2.5f;
+      title.outline = 2.0f;
+      title.glow = 2.0f;
+      title.outline_a = 0.8f;
+      text_layer->SetLabels({label, title});
     }
 #endif
 
@@ -104,6 +136,7 @@ int main(int, char**) {
   SDL_GL_SetSwapInterval(1);
 
   window = std::unique_ptr<Window>(new Window(800, 600));
+  workers = std::unique_ptr<WorkerPool>(new WorkerPool);
 
   Font font("imgui/misc/fonts/DroidSans.ttf", 32);
 
@@ -119,7 +152,14 @@ int main(int, char**) {
 
 #if SHOW_SPRITES
   sprite_layer = std::unique_ptr<RenderSprites>(new RenderSprites);
+  sprite_layer->SetWorkerPool(workers.get());
+  if (!sprite_layer->LoadBakedAtlas("assets/sprites.atlas")) {
+    sprite_layer->LoadImage("assets/red-blob.png");
+  }
   window->AddLayer(sprite_layer.get());
+  for (int j = 0; j < SIDE * SIDE; j++) {
+    sprite_ids.push_back(sprite_layer->CreateSprite(make_sprite(j)));
+  }
 #endif
 
 #if SHOW_SHAPES
@@ -132,6 +172,13 @@ int main(int, char**) {
   window->AddLayer(overlay_layer.get());
 #endif
 
+#if SHOW_TEXT
+  text_font = std::unique_ptr<Font>(new Font("imgui/misc/fonts/DroidSans.ttf", 20));
+  sdf_font = std::unique_ptr<Font>(new Font("imgui/misc/fonts/DroidSans.ttf", 32, 0.0, true));
+  text_layer = std::unique_ptr<RenderText>(new RenderText);
+  window->AddLayer(text_layer.get());
+#endif
+
 #if SHOW_IMGUI
   std::unique_ptr<RenderImGui> ui_layer(new RenderImGui());
   window->AddLayer(ui_layer.get());
@@ -149,6 +196,10 @@ int main(int, char**) {
 
   sprite_layer = nullptr;
   shape_layer = nullptr;
+  text_layer = nullptr;
+  text_font = nullptr;
+  sdf_font = nullptr;
+  workers = nullptr;
   window = nullptr;
   SDL_Quit();
 }
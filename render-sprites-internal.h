@@ -0,0 +1,34 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+/** The parts of RenderSprites that check.cpp tests directly. Only
+ * render-sprites.cpp and check.cpp should include this. */
+
+#ifndef RENDER_SPRITES_INTERNAL_H
+#define RENDER_SPRITES_INTERNAL_H
+
+#include "render-sprites.h"
+#include "glwrappers.h"
+
+// The rotation and scale are applied on the cpu, once per sprite,
+// so each vertex only needs its final position. Texture coordinates
+// are 0-65535, normalized to 0.0-1.0 by OpenGL.
+struct Attributes {
+  GLfloat position[2]; // location of corner in world coordinates
+  GLushort texcoord[2]; // texture s,t of this corner
+};
+
+// Texture coordinates for the four corners, as stored in Attributes
+struct QuadTexcoords {
+  GLushort s0, t0, s1, t1;
+};
+
+// Write the four vertices for a sprite. ExpandSprite uses SIMD when
+// the compiler targets SSE2, NEON or wasm simd128, and has to give
+// the same bytes as ExpandSpriteScalar.
+void ExpandSpriteScalar(const Sprite& S, const SpriteLocation& loc,
+                        const QuadTexcoords& tex, Attributes* vertices);
+void ExpandSprite(const Sprite& S, const SpriteLocation& loc,
+                  const QuadTexcoords& tex, Attributes* vertices);
+
+#endif
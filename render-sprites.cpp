@@ -2,47 +2,221 @@
 // License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
 
 #include "render-sprites.h"
+#include "render-sprites-internal.h"
 #include "window.h"
 #include "atlas.h"
+#include "worker-pool.h"
 
 #include <SDL.h>
 #include "glwrappers.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
 
-struct Attributes {
-  GLfloat corner[2];   // location of corner relative to center, in world coords
-  GLfloat texcoord[2]; // texture s,t of this corner
-  GLfloat position[2]; // location of center in world coordinates
-  GLfloat rotation;    // rotation in radians
+
+// With instancing, each sprite is one record instead of four
+// vertices, and the vertex shader places the corners of a shared unit
+// quad. The bounds are scaled on the cpu, and the shader does the
+// same rotation as ExpandSprite. The shader also does the animation,
+// so animated sprites don't have to be uploaded every frame.
+struct Instance {
+  GLfloat center[2];    // sprite position in world coordinates
+  GLfloat rotation[2];  // cos, sin of the rotation angle
+  GLfloat bounds[4];    // x0,y0,x1,y1, scaled
+  GLushort texcoord[4]; // s0,t0,s1,t1 of the first frame
+  GLfloat velocity[2];  // world units per second
+  GLfloat animation[4]; // radians per second, start time, frame rate, frames
+  GLfloat frame_width;  // in texture coordinates
+};
+
+// Half-open range of sprite numbers [begin, end)
+struct SpriteRange {
+  int begin, end;
+};
+
+// One glDrawElements call. Without 32-bit indices, first_vertex moves
+// the attribute pointers to the start of a batch. With instancing,
+// it's one glDrawArraysInstanced call, and first_vertex is the first
+// instance.
+struct DrawRun {
+  int page;
+  int first_vertex;
+  int first_index;
+  int count; // in indices
+};
+
+/* For culling, each sprite is put in the grid cell containing its
+   center. A query looks at the cells overlapping the view, expanded
+   by the largest sprite radius, so the cost depends on how many
+   sprites are near the view rather than how many there are in all. */
+struct SpriteGrid {
+  float cell_size;
+  float max_radius;
+  std::unordered_map<int64_t, std::vector<int>> cells;
+  std::vector<int64_t> slot_cell;  // which cell each sprite is in
+  std::vector<int> slot_index;     // where in that cell's vector
+  std::vector<float> slot_radius;  // bounding circle, world units
+
+  SpriteGrid(): cell_size(1.0f), max_radius(0.0f) {}
+  static int64_t Key(int32_t ix, int32_t iy);
+  int64_t Key(float x, float y) const;
+  void Clear();
+  void Insert(int j, float x, float y, float radius);
+  void Remove(int j);
+  void Truncate(int n);
 };
 
 struct RenderSpritesImpl {
+  // Each atlas page is a separate texture. When the atlas is rebuilt,
+  // images can move to other pages.
   Atlas atlas;
+  std::vector<std::unique_ptr<Texture>> textures;
+  int atlas_generation;
+  std::vector<int> image_frames; // sprite sheet frames, side by side
+  bool release_surfaces;
+  bool release_pending; // set before anything's uploaded since release_surfaces
   
+  // Sprites live in slots. Destroyed slots go on a free list to be
+  // reused, and are drawn as zero-size quads until then. Sprites that
+  // were changed since the last Render() are expanded into vertices
+  // at the start of the next Render().
   std::vector<Sprite> sprites;
+  std::vector<int> free_slots;
+  std::vector<bool> is_free;
+  std::vector<int> changed;
+  std::vector<bool> is_changed;
   std::vector<Attributes> vertices;
-  std::vector<GLushort> indices;
+  std::vector<Instance> instances;
+
+  // Sprites are drawn sorted by depth and then page, so that each
+  // page is one draw call per depth. The key counts tell me when all
+  // sprites have the same key, so that sorting isn't needed.
+  std::vector<uint32_t> slot_key;
+  std::vector<bool> has_key;
+  std::unordered_map<uint32_t, int> key_counts;
+
+  // Animated sprites are evaluated at this time. The instanced path
+  // does that in the vertex shader; otherwise the animated sprites
+  // are expanded again every frame.
+  float time;
+  std::vector<int> animated;
+  std::vector<int> animated_index; // position in animated, or -1
+
+  // The sorted draw list is kept from frame to frame. Without culling,
+  // it only changes when a sprite is created or destroyed, or its
+  // depth or page changes.
+  std::vector<int> draw_list;
+  std::vector<int> sort_scratch;
+  bool draw_list_dirty;
+  WorkerPool* workers;
+
+  // Desktop GL and most WebGL implementations can use 32-bit indices,
+  // so that one draw call covers all the sprites. Without them I use
+  // 16-bit indices and draw the sprites in batches.
+  bool uint_indices;
   
   ShaderProgram shader;
-  Texture texture;
   
+  // The index buffer only depends on the number of sprites, so it's
+  // rebuilt only when it needs to grow. The vertex buffer is
+  // reallocated when it needs to grow; otherwise only the sprites
+  // that changed since the last Render() are uploaded.
   VertexBuffer vbo_attributes;
   VertexBuffer vbo_index;
+  int index_capacity;  // in sprites
+  int vertex_capacity; // in sprites
+  std::vector<SpriteRange> dirty;
+  bool attributes_stale;
+  std::vector<DrawRun> runs;
+
+  // Camera, in world coordinates
+  float camera_x, camera_y, camera_zoom;
+
+  // With culling, the sprites overlapping the view are found with
+  // the grid. A changed sprite is moved in the grid once, and then
+  // marked stale; it's only expanded once it's visible. With culling
+  // or sorting, the draw list is drawn with a per-frame index buffer
+  // instead of the static one.
+  bool culling;
+  bool grid_needs_rebuild;
+  SpriteGrid grid;
+  std::vector<float> image_radius;
+  std::vector<int> visible;
+  std::vector<bool> is_stale;
+  std::vector<int> uploaded_draw_list;
+  VertexBuffer vbo_draw_list_index;
   
   // Uniforms
   GLint loc_u_camera_position;
   GLint loc_u_camera_scale;
   GLint loc_u_texture;
   
-  // Attributes per sprite
-  GLint loc_a_corner;
-  GLint loc_a_texcoord;
+  // Attributes per vertex
   GLint loc_a_position;
+  GLint loc_a_texcoord;
+
+  // When instancing is available, sprites are records instead of
+  // vertices. The draw list is drawn by copying its records, in
+  // order, into a separate buffer, because WebGL has no way to draw
+  // instances from a list of ids. While the order stays the same,
+  // only the records that changed are copied, to their positions in
+  // the draw list. The vertex buffer isn't drawn from then, so it's
+  // left stale until it is.
+  InstancedArrays instancing;
+  bool instanced;
+  std::unique_ptr<ShaderProgram> instanced_shader;
+  VertexBuffer vbo_quad;
+  VertexBuffer vbo_draw_list_instances;
+  std::vector<Instance> draw_list_instances;
+  std::vector<int> draw_list_position;
+  GLint loc_i_camera_position;
+  GLint loc_i_camera_scale;
+  GLint loc_i_texture;
+  GLint loc_i_time;
+  GLint loc_a_corner;
+  GLint loc_a_center;
   GLint loc_a_rotation;
+  GLint loc_a_bounds;
+  GLint loc_a_texcoords;
+  GLint loc_a_velocity;
+  GLint loc_a_animation;
+  GLint loc_a_frame_width;
 
   RenderSpritesImpl();
+  const SpriteLocation& Location(int image_id) const;
+  uint32_t SortKey(const Sprite& sprite) const;
+  void TrackSlot(int j, bool live);
+  void SetAnimated(int j, bool animate);
+  void UploadPages();
+  void BuildDrawList();
+  void MarkChanged(int j);
+  void ExpandChanged();
+  void MarkDirty(int j);
+  float ImageRadius(int image_id);
+  void UpdateGrid();
+  void InsertIntoGrid(int j);
+  void Position(int j, float* x, float* y) const;
+  void FindVisible(float left, float top, float right, float bottom);
+  void UploadIndices(int capacity);
+  void UploadDrawListIndices();
+  void UploadDrawListInstances(bool list_changed);
+  void UploadVertices(bool reset);
+  void SetAttribPointers(int first_vertex);
+  void SetInstancePointers(int first_instance);
+  void DrawElements(bool use_draw_list);
+  void DrawInstanced(bool use_draw_list);
 };
 
 
@@ -54,22 +228,55 @@ namespace {
   GLchar vertex_shader[] = R"(
   uniform vec2 u_camera_position;
   uniform vec2 u_camera_scale;
-  attribute vec2 a_corner;
-  attribute vec2 a_texcoord;
   attribute vec2 a_position;
-  attribute float a_rotation;
+  attribute vec2 a_texcoord;
   varying vec2 v_texcoord;
   
   void main() {
-    mat2 rot = mat2(cos(a_rotation), -sin(a_rotation), sin(a_rotation), cos(a_rotation));
-    vec2 local_coords = a_corner * rot;
-    vec2 world_coords = local_coords + a_position;
-    vec2 screen_coords = (world_coords - u_camera_position) * u_camera_scale;
+    vec2 screen_coords = (a_position - u_camera_position) * u_camera_scale;
     gl_Position = vec4(screen_coords, 0.0, 1.0);
     v_texcoord = a_texcoord;
   }
 )";
 
+  // The instanced version of the vertex shader gets the same
+  // information per sprite instead of per vertex, and uses the corner
+  // (0 or 1 in each axis) to pick out the values for this vertex.
+  // For sprites that aren't animated, the turn is 0 and the frame is
+  // 0, so the result is the same as without the animation.
+  GLchar instanced_vertex_shader[] = R"(
+  uniform vec2 u_camera_position;
+  uniform vec2 u_camera_scale;
+  uniform float u_time;
+  attribute vec2 a_corner;
+  attribute vec2 a_center;
+  attribute vec2 a_rotation;
+  attribute vec4 a_bounds;
+  attribute vec4 a_texcoords;
+  attribute vec2 a_velocity;
+  attribute vec4 a_animation;
+  attribute float a_frame_width;
+  varying vec2 v_texcoord;
+  
+  void main() {
+    float dt = u_time - a_animation.y;
+    float turn = a_animation.x * dt;
+    vec2 r = vec2(cos(turn), sin(turn));
+    vec2 rotation = vec2(a_rotation.x * r.x - a_rotation.y * r.y,
+                         a_rotation.y * r.x + a_rotation.x * r.y);
+    vec2 center = a_center + a_velocity * dt;
+    float frame = mod(floor(dt * a_animation.z), a_animation.w);
+    
+    vec2 p = mix(a_bounds.xy, a_bounds.zw, a_corner);
+    vec2 world = vec2(p.x * rotation.x - p.y * rotation.y,
+                      p.x * rotation.y + p.y * rotation.x) + center;
+    vec2 screen_coords = (world - u_camera_position) * u_camera_scale;
+    gl_Position = vec4(screen_coords, 0.0, 1.0);
+    v_texcoord = mix(a_texcoords.xy, a_texcoords.zw, a_corner)
+      + vec2(frame * a_frame_width, 0.0);
+  }
+)";
+
   GLchar fragment_shader[] = R"(
   uniform sampler2D u_texture;
   varying vec2 v_texcoord;
@@ -81,81 +288,1073 @@ namespace {
 
 
 RenderSpritesImpl::RenderSpritesImpl()
-  :shader(vertex_shader, fragment_shader)
+  :shader(vertex_shader, fragment_shader), index_capacity(0), vertex_capacity(0),
+   camera_x(0.0f), camera_y(0.0f), camera_zoom(1.0f),
+   culling(false), grid_needs_rebuild(false)
 {
+  atlas_generation = -1;
+  draw_list_dirty = true;
+  attributes_stale = false;
+  release_surfaces = false;
+  release_pending = false;
+  time = 0.0f;
+  workers = nullptr;
   loc_u_camera_position = glGetUniformLocation(shader.id, "u_camera_position");
   loc_u_camera_scale = glGetUniformLocation(shader.id, "u_camera_scale");
   loc_u_texture = glGetUniformLocation(shader.id, "u_texture");
-  loc_a_corner = glGetAttribLocation(shader.id, "a_corner");
-  loc_a_texcoord = glGetAttribLocation(shader.id, "a_texcoord");
   loc_a_position = glGetAttribLocation(shader.id, "a_position");
-  loc_a_rotation = glGetAttribLocation(shader.id, "a_rotation");
+  loc_a_texcoord = glGetAttribLocation(shader.id, "a_texcoord");
+
+#ifdef __EMSCRIPTEN__
+  uint_indices = HasGLExtension("GL_OES_element_index_uint");
+#else
+  uint_indices = true;
+#endif
 
-  atlas.LoadImage("assets/red-blob.png");
-  texture.CopyFromSurface(atlas.GetSurface());
+  instanced = instancing.Available();
+  if (instanced) {
+    instanced_shader.reset(new ShaderProgram(instanced_vertex_shader, fragment_shader));
+    GLuint id = instanced_shader->id;
+    loc_i_camera_position = glGetUniformLocation(id, "u_camera_position");
+    loc_i_camera_scale = glGetUniformLocation(id, "u_camera_scale");
+    loc_i_texture = glGetUniformLocation(id, "u_texture");
+    loc_i_time = glGetUniformLocation(id, "u_time");
+    loc_a_corner = glGetAttribLocation(id, "a_corner");
+    loc_a_center = glGetAttribLocation(id, "a_center");
+    loc_a_rotation = glGetAttribLocation(id, "a_rotation");
+    loc_a_bounds = glGetAttribLocation(id, "a_bounds");
+    loc_a_texcoords = glGetAttribLocation(id, "a_texcoords");
+    loc_a_velocity = glGetAttribLocation(id, "a_velocity");
+    loc_a_animation = glGetAttribLocation(id, "a_animation");
+    loc_a_frame_width = glGetAttribLocation(id, "a_frame_width");
+
+    // The corners in the same order as the vertices from ExpandSprite,
+    // so that a triangle strip makes the same two triangles
+    static const GLubyte corners[8] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_quad.id);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+  }
 }
 
 
 namespace {
   static const GLushort corner_index[6] = { 0, 1, 2, 2, 1, 3 };
+
+  // 16-bit indices can only reach 65536 vertices, so that's the most
+  // sprites I can draw in one batch. Every batch uses the same
+  // indices; I move the attribute pointers to the start of the batch.
+  const int SPRITES_PER_BATCH = 65536 / 4;
+
+  // Below this many changed sprites, it's faster to expand them on
+  // one thread than to wake up the workers
+  const int PARALLEL_THRESHOLD = 4096;
+
+  // Uploading a few unchanged sprites is cheaper than making another
+  // glBufferSubData call, so uploads that are this close are merged
+  const int MERGE_GAP = 16;
+
+  GLushort QuantizeTexcoord(float s) {
+    return GLushort(std::min(std::max(s, 0.0f), 1.0f) * 65535.0f + 0.5f);
+  }
+
+  // A sprite sheet's frames are side by side in the image
+  QuadTexcoords QuantizeTexcoords(const SpriteLocation& loc, int frames, int frame) {
+    float frame_width = (loc.s1 - loc.s0) / frames;
+    return QuadTexcoords{QuantizeTexcoord(loc.s0 + frame_width * frame),
+                         QuantizeTexcoord(loc.t0),
+                         QuantizeTexcoord(loc.s0 + frame_width * (frame + 1)),
+                         QuantizeTexcoord(loc.t1)};
+  }
+
+  bool IsAnimated(const Sprite& S) {
+    return std::abs(S.vx) > 0.0f || std::abs(S.vy) > 0.0f || std::abs(S.angular_velocity) > 0.0f
+      || (S.num_frames > 1 && std::abs(S.frame_rate) > 0.0f);
+  }
+
+  // The cpu version of the animation in the instanced vertex shader.
+  // Returns the sprite as it is at this time, and its frame number.
+  Sprite Animate(const Sprite& S, float time, int* frame) {
+    Sprite A = S;
+    float dt = time - S.start_time;
+    A.x += S.vx * dt;
+    A.y += S.vy * dt;
+    A.rotation_degrees += S.angular_velocity * dt;
+    float k = std::floor(dt * S.frame_rate);
+    float n = float(std::max(S.num_frames, 1));
+    *frame = S.first_frame + int(k - n * std::floor(k / n));
+    return A;
+  }
+
+  inline void SetTexcoords(const QuadTexcoords& tex, Attributes* vertices) {
+    vertices[0].texcoord[0] = tex.s0;
+    vertices[0].texcoord[1] = tex.t0;
+    vertices[1].texcoord[0] = tex.s1;
+    vertices[1].texcoord[1] = tex.t0;
+    vertices[2].texcoord[0] = tex.s0;
+    vertices[2].texcoord[1] = tex.t1;
+    vertices[3].texcoord[0] = tex.s1;
+    vertices[3].texcoord[1] = tex.t1;
+  }
+}
+
+
+// Write the four vertices for a sprite. This is the reference
+// version; the SIMD versions below have to produce the same bits,
+// so they do the same float operations in the same order.
+void ExpandSpriteScalar(const Sprite& S, const SpriteLocation& loc,
+                        const QuadTexcoords& tex, Attributes* vertices) {
+  float angle = S.rotation_degrees / DEG_TO_RAD;
+  float c = std::cos(angle), s = std::sin(angle);
+  float x0 = loc.x0 * S.scale, y0 = loc.y0 * S.scale;
+  float x1 = loc.x1 * S.scale, y1 = loc.y1 * S.scale;
+  vertices[0].position[0] = x0 * c - y0 * s + S.x;
+  vertices[0].position[1] = x0 * s + y0 * c + S.y;
+  vertices[1].position[0] = x1 * c - y0 * s + S.x;
+  vertices[1].position[1] = x1 * s + y0 * c + S.y;
+  vertices[2].position[0] = x0 * c - y1 * s + S.x;
+  vertices[2].position[1] = x0 * s + y1 * c + S.y;
+  vertices[3].position[0] = x1 * c - y1 * s + S.x;
+  vertices[3].position[1] = x1 * s + y1 * c + S.y;
+  SetTexcoords(tex, vertices);
+}
+
+// The SIMD versions compute all four corners at once. The scaled
+// (x0,y0,x1,y1) is shuffled into X = (x0,x1,x0,x1) and Y =
+// (y0,y0,y1,y1), rotated and moved, then interleaved back into x,y
+// pairs. The choice is made at compile time; SSE2 is always there
+// on x86-64 and NEON on arm64, and emscripten needs -msimd128. I
+// didn't write an AVX2 version because a sprite is only four
+// corners wide.
+static_assert(offsetof(SpriteLocation, y1) == 3 * sizeof(float),
+              "SpriteLocation must start with x0,y0,x1,y1");
+
+#if defined(__SSE2__)
+void ExpandSprite(const Sprite& S, const SpriteLocation& loc,
+                  const QuadTexcoords& tex, Attributes* vertices) {
+  float angle = S.rotation_degrees / DEG_TO_RAD;
+  __m128 C = _mm_set1_ps(std::cos(angle)), Sn = _mm_set1_ps(std::sin(angle));
+  __m128 L = _mm_mul_ps(_mm_loadu_ps(&loc.x0), _mm_set1_ps(S.scale));
+  __m128 X = _mm_shuffle_ps(L, L, _MM_SHUFFLE(2, 0, 2, 0));
+  __m128 Y = _mm_shuffle_ps(L, L, _MM_SHUFFLE(3, 3, 1, 1));
+  __m128 WX = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(X, C), _mm_mul_ps(Y, Sn)), _mm_set1_ps(S.x));
+  __m128 WY = _mm_add_ps(_mm_add_ps(_mm_mul_ps(X, Sn), _mm_mul_ps(Y, C)), _mm_set1_ps(S.y));
+  __m128 lo = _mm_unpacklo_ps(WX, WY), hi = _mm_unpackhi_ps(WX, WY);
+  _mm_storel_pi(reinterpret_cast<__m64*>(vertices[0].position), lo);
+  _mm_storeh_pi(reinterpret_cast<__m64*>(vertices[1].position), lo);
+  _mm_storel_pi(reinterpret_cast<__m64*>(vertices[2].position), hi);
+  _mm_storeh_pi(reinterpret_cast<__m64*>(vertices[3].position), hi);
+  SetTexcoords(tex, vertices);
+}
+#elif defined(__ARM_NEON)
+void ExpandSprite(const Sprite& S, const SpriteLocation& loc,
+                  const QuadTexcoords& tex, Attributes* vertices) {
+  float angle = S.rotation_degrees / DEG_TO_RAD;
+  float32x4_t C = vdupq_n_f32(std::cos(angle)), Sn = vdupq_n_f32(std::sin(angle));
+  float32x4_t L = vmulq_n_f32(vld1q_f32(&loc.x0), S.scale);
+  float32x4_t X = vuzpq_f32(L, L).val[0];
+  float32x4_t Y = vcombine_f32(vdup_lane_f32(vget_low_f32(L), 1),
+                               vdup_lane_f32(vget_high_f32(L), 1));
+  float32x4_t WX = vaddq_f32(vsubq_f32(vmulq_f32(X, C), vmulq_f32(Y, Sn)), vdupq_n_f32(S.x));
+  float32x4_t WY = vaddq_f32(vaddq_f32(vmulq_f32(X, Sn), vmulq_f32(Y, C)), vdupq_n_f32(S.y));
+  float32x4x2_t XY = vzipq_f32(WX, WY);
+  vst1_f32(vertices[0].position, vget_low_f32(XY.val[0]));
+  vst1_f32(vertices[1].position, vget_high_f32(XY.val[0]));
+  vst1_f32(vertices[2].position, vget_low_f32(XY.val[1]));
+  vst1_f32(vertices[3].position, vget_high_f32(XY.val[1]));
+  SetTexcoords(tex, vertices);
+}
+#elif defined(__wasm_simd128__)
+void ExpandSprite(const Sprite& S, const SpriteLocation& loc,
+                  const QuadTexcoords& tex, Attributes* vertices) {
+  float angle = S.rotation_degrees / DEG_TO_RAD;
+  v128_t C = wasm_f32x4_splat(std::cos(angle)), Sn = wasm_f32x4_splat(std::sin(angle));
+  v128_t L = wasm_f32x4_mul(wasm_v128_load(&loc.x0), wasm_f32x4_splat(S.scale));
+  v128_t X = wasm_i32x4_shuffle(L, L, 0, 2, 0, 2);
+  v128_t Y = wasm_i32x4_shuffle(L, L, 1, 1, 3, 3);
+  v128_t WX = wasm_f32x4_add(wasm_f32x4_sub(wasm_f32x4_mul(X, C), wasm_f32x4_mul(Y, Sn)),
+                             wasm_f32x4_splat(S.x));
+  v128_t WY = wasm_f32x4_add(wasm_f32x4_add(wasm_f32x4_mul(X, Sn), wasm_f32x4_mul(Y, C)),
+                             wasm_f32x4_splat(S.y));
+  v128_t lo = wasm_i32x4_shuffle(WX, WY, 0, 4, 1, 5);
+  v128_t hi = wasm_i32x4_shuffle(WX, WY, 2, 6, 3, 7);
+  wasm_v128_store64_lane(vertices[0].position, lo, 0);
+  wasm_v128_store64_lane(vertices[1].position, lo, 1);
+  wasm_v128_store64_lane(vertices[2].position, hi, 0);
+  wasm_v128_store64_lane(vertices[3].position, hi, 1);
+  SetTexcoords(tex, vertices);
+}
+#else
+void ExpandSprite(const Sprite& S, const SpriteLocation& loc,
+                  const QuadTexcoords& tex, Attributes* vertices) {
+  ExpandSpriteScalar(S, loc, tex, vertices);
+}
+#endif
+
+
+namespace {
+  // The instancing version of ExpandSprite leaves the rotation and
+  // translation to the vertex shader
+  void FillInstance(const Sprite& S, const SpriteLocation& loc, int frames,
+                    const QuadTexcoords& tex, Instance* instance) {
+    float angle = S.rotation_degrees / DEG_TO_RAD;
+    instance->center[0] = S.x;
+    instance->center[1] = S.y;
+    instance->rotation[0] = std::cos(angle);
+    instance->rotation[1] = std::sin(angle);
+    instance->bounds[0] = loc.x0 * S.scale;
+    instance->bounds[1] = loc.y0 * S.scale;
+    instance->bounds[2] = loc.x1 * S.scale;
+    instance->bounds[3] = loc.y1 * S.scale;
+    instance->texcoord[0] = tex.s0;
+    instance->texcoord[1] = tex.t0;
+    instance->texcoord[2] = tex.s1;
+    instance->texcoord[3] = tex.t1;
+    instance->velocity[0] = S.vx;
+    instance->velocity[1] = S.vy;
+    instance->animation[0] = S.angular_velocity / DEG_TO_RAD;
+    instance->animation[1] = S.start_time;
+    instance->animation[2] = S.frame_rate;
+    instance->animation[3] = float(std::max(S.num_frames, 1));
+    instance->frame_width = (loc.s1 - loc.s0) / frames;
+  }
+}
+
+
+int RenderSprites::CreateSprite(const Sprite& sprite) {
+  int id;
+  if (!self->free_slots.empty()) {
+    id = self->free_slots.back();
+    self->free_slots.pop_back();
+    self->sprites[id] = sprite;
+    self->is_free[id] = false;
+  } else {
+    id = self->sprites.size();
+    self->sprites.push_back(sprite);
+    self->is_free.push_back(false);
+    self->is_changed.push_back(false);
+    self->is_stale.push_back(false);
+  }
+  self->TrackSlot(id, true);
+  self->MarkChanged(id);
+  return id;
+}
+
+
+void RenderSprites::UpdateSprite(int id, const Sprite& sprite) {
+  if (id < 0 || id >= int(self->sprites.size())) { FAIL("UpdateSprite on an invalid id"); }
+  if (self->is_free[id]) { FAIL("UpdateSprite on a destroyed sprite"); }
+  Sprite& S = self->sprites[id];
+  if (std::memcmp(&S, &sprite, sizeof(Sprite)) != 0) {
+    S = sprite;
+    self->TrackSlot(id, true);
+    self->MarkChanged(id);
+  }
+}
+
+
+void RenderSprites::DestroySprite(int id) {
+  // Destroying an id twice would put it on the free list twice, and
+  // then hand it out to two sprites
+  if (id < 0 || id >= int(self->sprites.size())) { FAIL("DestroySprite on an invalid id"); }
+  if (self->is_free[id]) { FAIL("DestroySprite on a destroyed sprite"); }
+  // A sprite with scale 0 has no area, so it won't draw anything
+  self->sprites[id].scale = 0.0f;
+  self->TrackSlot(id, false);
+  self->MarkChanged(id);
+  self->free_slots.push_back(id);
+  self->is_free[id] = true;
+}
+
+
+int RenderSprites::LoadImage(const char* filename, int frames) {
+  int id = self->atlas.LoadImage(filename, frames <= 1);
+  self->image_frames.push_back(std::max(frames, 1));
+  return id;
+}
+
+
+std::vector<int> RenderSprites::LoadImages(const std::vector<std::string>& filenames) {
+  std::vector<int> ids = self->atlas.LoadImages(filenames, self->workers);
+  self->image_frames.resize(self->atlas.NumImages(), 1);
+  return ids;
+}
+
+
+bool RenderSprites::LoadBakedAtlas(const char* path) {
+  if (!self->atlas.LoadBaked(path)) { return false; }
+  self->image_frames.assign(self->atlas.NumImages(), 1);
+  return true;
+}
+
+void RenderSprites::SetTextureFormat(TextureFormat format, bool dither) {
+  // The textures are made again at the start of the next Render
+  self->atlas.SetTextureFormat(format, dither);
+  self->textures.clear();
+  // Released pages don't have the old images any more
+  if (self->release_surfaces) { self->atlas.Rebuild(); }
+}
+
+
+void RenderSprites::SetReleaseSurfaces(bool release) {
+  // Images added since the last upload are only in the page surfaces,
+  // so they're released after the next upload, not here
+  self->release_surfaces = release;
+  self->release_pending = release;
+}
+
+
+AtlasStats RenderSprites::GetAtlasStats() const {
+  return self->atlas.GetStats();
+}
+
+
+void RenderSprites::SetWorkerPool(WorkerPool* workers) {
+  self->workers = workers;
+}
+
+
+bool RenderSprites::SetInstancing(bool enabled) {
+  bool instanced = enabled && self->instancing.Available();
+  if (instanced != self->instanced) {
+    // The other kind of record has to be made for every sprite, and
+    // the buffers have to be reallocated for the new record size
+    self->instanced = instanced;
+    self->vertices.clear();
+    self->instances.clear();
+    self->vertex_capacity = 0;
+    self->uploaded_draw_list.clear();
+    self->draw_list_dirty = true;
+    for (int j = 0; j < int(self->sprites.size()); j++) {
+      self->MarkChanged(j);
+    }
+  }
+  return instanced;
+}
+
+
+void RenderSprites::SetTime(float seconds) {
+  self->time = seconds;
+}
+
+
+void RenderSprites::SetCamera(float x, float y, float zoom) {
+  self->camera_x = x;
+  self->camera_y = y;
+  self->camera_zoom = zoom;
+}
+
+
+void RenderSprites::SetCulling(bool enabled, float cell_size) {
+  // Without culling, everything is drawn, so the stale sprites have
+  // to be expanded now
+  if (self->culling && !enabled) {
+    for (int j = 0; j < int(self->is_stale.size()); j++) {
+      if (self->is_stale[j]) {
+        self->is_stale[j] = false;
+        self->MarkChanged(j);
+      }
+    }
+  }
+  self->culling = enabled;
+  self->draw_list_dirty = true;
+  self->grid.Clear();
+  self->grid.cell_size = cell_size;
+  self->grid_needs_rebuild = enabled;
 }
 
 
 void RenderSprites::SetSprites(const std::vector<Sprite>& sprites) {
-  auto& vertices = self->vertices;
-  auto& indices = self->indices;
-  
+  // Only the sprites that differ from last time have to be expanded
+  // into vertices and uploaded
   int N = sprites.size();
-  vertices.resize(N * 4);
+  int unchanged = std::min(N, int(self->sprites.size()));
+  for (int j = N; j < int(self->sprites.size()); j++) {
+    self->TrackSlot(j, false);
+  }
+  for (int j : self->free_slots) {
+    if (j < N) {
+      self->is_free[j] = false;
+      self->TrackSlot(j, true);
+    }
+  }
+  self->sprites.resize(N);
+  self->is_changed.resize(N, false);
+  self->is_stale.resize(N, false);
+  self->grid.Truncate(N);
+  self->free_slots.clear();
+  self->is_free.resize(N, false);
   for (int j = 0; j < N; j++) {
+    if (j < unchanged && std::memcmp(&sprites[j], &self->sprites[j], sizeof(Sprite)) == 0) {
+      continue;
+    }
+    self->sprites[j] = sprites[j];
+    self->TrackSlot(j, true);
+    self->MarkChanged(j);
+  }
+}
+
+
+const SpriteLocation& RenderSpritesImpl::Location(int image_id) const {
+  return atlas.GetLocation(image_id);
+}
+
+
+uint32_t RenderSpritesImpl::SortKey(const Sprite& sprite) const {
+  uint32_t depth = std::min(std::max(sprite.depth + 32768, 0), 65535);
+  uint32_t page = Location(sprite.image_id).page;
+  return (depth << 16) | page;
+}
+
+
+void RenderSpritesImpl::TrackSlot(int j, bool live) {
+  SetAnimated(j, live && IsAnimated(sprites[j]));
+  if (j >= int(slot_key.size())) {
+    slot_key.resize(j + 1, 0);
+    has_key.resize(j + 1, false);
+  }
+  uint32_t key = live? SortKey(sprites[j]) : 0;
+  if (has_key[j] == live && (!live || slot_key[j] == key)) { return; }
+  draw_list_dirty = true;
+  if (has_key[j]) {
+    auto count = key_counts.find(slot_key[j]);
+    if (--count->second == 0) { key_counts.erase(count); }
+  }
+  has_key[j] = live;
+  if (live) {
+    slot_key[j] = key;
+    key_counts[key]++;
+  }
+}
+
+
+void RenderSpritesImpl::SetAnimated(int j, bool animate) {
+  if (j >= int(animated_index.size())) {
+    animated_index.resize(j + 1, -1);
+  }
+  if (animate && animated_index[j] < 0) {
+    animated_index[j] = animated.size();
+    animated.push_back(j);
+  } else if (!animate && animated_index[j] >= 0) {
+    // Move the last animated sprite into the removed sprite's place
+    int moved = animated.back();
+    animated[animated_index[j]] = moved;
+    animated_index[moved] = animated_index[j];
+    animated.pop_back();
+    animated_index[j] = -1;
+  }
+}
+
+
+void RenderSpritesImpl::UploadPages() {
+  // Rebuilding the atlas moves all of its images, so all the sprites
+  // have to be expanded again, and sorted by their new pages. Images
+  // added without a rebuild don't move the others, and only their
+  // rects need to be uploaded, unless they started a new page.
+  int num_pages = atlas.NumPages();
+  bool rebuilt = atlas_generation != atlas.GetGeneration();
+  if (rebuilt) {
+    textures.clear();
+    atlas_generation = atlas.GetGeneration();
+  }
+  bool uploaded = false;
+  for (int p = 0; p < num_pages; p++) {
+    // A released page only gets a surface again when it's needed
+    std::vector<SDL_Rect> added = atlas.TakeAddedRects(p);
+    if (p >= int(textures.size())) {
+      textures.emplace_back(new Texture(atlas.GetSurface(p), atlas.GetTextureFormat(),
+                                        atlas.GetDither()));
+      uploaded = true;
+    } else if (!added.empty()) {
+      SDL_Surface* surface = atlas.GetSurface(p);
+      for (const SDL_Rect& rect : added) {
+        textures[p]->CopyRectFromSurface(surface, rect);
+      }
+      uploaded = true;
+    }
+  }
+  if (release_surfaces && (uploaded || release_pending)) {
+    atlas.ReleaseSurfaces();
+    release_pending = false;
+  }
+  if (rebuilt) {
+    image_radius.clear();
+    for (int j = 0; j < int(sprites.size()); j++) {
+      if (!is_free[j]) {
+        TrackSlot(j, true);
+        MarkChanged(j);
+      }
+    }
+  }
+}
+
+
+namespace {
+  // Stable LSD radix sort of sprite ids by their keys, a byte at a
+  // time. Bytes that are the same for every sprite are skipped, so
+  // the common case of a few pages and depths is one or two passes.
+  void RadixSort(std::vector<int>& items, std::vector<int>& scratch,
+                 const std::vector<uint32_t>& keys) {
+    scratch.resize(items.size());
+    for (int shift = 0; shift < 32; shift += 8) {
+      size_t offsets[257] = {0};
+      for (int j : items) {
+        offsets[((keys[j] >> shift) & 0xff) + 1]++;
+      }
+      if (std::find(offsets + 1, offsets + 257, items.size()) != offsets + 257) {
+        continue;
+      }
+      for (int b = 0; b < 256; b++) {
+        offsets[b + 1] += offsets[b];
+      }
+      for (int j : items) {
+        scratch[offsets[(keys[j] >> shift) & 0xff]++] = j;
+      }
+      items.swap(scratch);
+    }
+  }
+}
+
+
+void RenderSpritesImpl::BuildDrawList() {
+  if (culling) {
+    draw_list = visible;
+  } else {
+    draw_list.clear();
+    for (int j = 0; j < int(sprites.size()); j++) {
+      if (!is_free[j]) { draw_list.push_back(j); }
+    }
+  }
+  if (key_counts.size() > 1) {
+    RadixSort(draw_list, sort_scratch, slot_key);
+  }
+}
+
+
+void RenderSpritesImpl::MarkChanged(int j) {
+  if (!is_changed[j]) {
+    is_changed[j] = true;
+    changed.push_back(j);
+  }
+}
+
+
+void RenderSpritesImpl::ExpandChanged() {
+  // Remove changes to sprites that no longer exist
+  int N = sprites.size();
+  if (instanced) {
+    instances.resize(N);
+  } else {
+    vertices.resize(N * 4);
+  }
+  changed.erase(std::remove_if(changed.begin(), changed.end(),
+                               [N](int j) { return j >= N; }),
+                changed.end());
+
+  // Upload ranges are built in order, and the changes usually are
+  // already sorted, except when sprites get created into free
+  // slots. Duplicates can happen when SetSprites shrinks and regrows.
+  if (!std::is_sorted(changed.begin(), changed.end())) {
+    std::sort(changed.begin(), changed.end());
+  }
+  changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+  // Each sprite writes only its own four vertices, so the expansion
+  // can be split up across threads
+  auto expand = [this](int begin, int end) {
+    // Neighboring sprites often use the same image, so I only look
+    // up the location when the image changes
+    int image_id = -1, image_frame = -1, frames = 1;
+    const SpriteLocation* loc = nullptr;
+    QuadTexcoords tex;
+    for (int k = begin; k < end; k++) {
+      int j = changed[k];
+      Sprite S = sprites[j];
+      int sheet_frame = S.first_frame;
+      if (!instanced && j < int(animated_index.size()) && animated_index[j] >= 0) {
+        S = Animate(S, time, &sheet_frame);
+      }
+      if (S.image_id != image_id || sheet_frame != image_frame) {
+        image_id = S.image_id;
+        image_frame = sheet_frame;
+        loc = &Location(image_id);
+        frames = image_frames[image_id];
+        tex = QuantizeTexcoords(*loc, frames, sheet_frame);
+      }
+      if (instanced) {
+        FillInstance(S, *loc, frames, tex, &instances[j]);
+      } else {
+        ExpandSprite(S, *loc, tex, &vertices[j * 4]);
+      }
+    }
+  };
+  int num_changed = changed.size();
+  if (workers != nullptr && num_changed >= PARALLEL_THRESHOLD) {
+    workers->ParallelFor(num_changed, PARALLEL_THRESHOLD / 4, expand);
+  } else {
+    expand(0, num_changed);
+  }
+
+  for (int j : changed) {
+    is_changed[j] = false;
+    MarkDirty(j);
+  }
+  changed.clear();
+}
+
+
+void RenderSpritesImpl::MarkDirty(int j) {
+  // Merge ranges that are close together. The sprites don't have to
+  // come in order, so the range can grow in either direction, but
+  // never shrinks.
+  if (!dirty.empty() && dirty.back().end + MERGE_GAP >= j
+      && j >= dirty.back().begin - MERGE_GAP) {
+    dirty.back().begin = std::min(dirty.back().begin, j);
+    dirty.back().end = std::max(dirty.back().end, j + 1);
+  } else {
+    dirty.push_back(SpriteRange{j, j + 1});
+  }
+}
+
+
+namespace {
+  const int64_t NO_CELL = INT64_MIN;
+}
+
+int64_t SpriteGrid::Key(int32_t ix, int32_t iy) {
+  return int64_t((uint64_t(uint32_t(ix)) << 32) | uint32_t(iy));
+}
+
+int64_t SpriteGrid::Key(float x, float y) const {
+  return Key(int32_t(std::floor(x / cell_size)), int32_t(std::floor(y / cell_size)));
+}
+
+
+void SpriteGrid::Clear() {
+  cells.clear();
+  slot_cell.clear();
+  slot_index.clear();
+  slot_radius.clear();
+  max_radius = 0.0f;
+}
+
+
+void SpriteGrid::Insert(int j, float x, float y, float radius) {
+  if (j >= int(slot_cell.size())) {
+    slot_cell.resize(j + 1, NO_CELL);
+    slot_index.resize(j + 1, -1);
+    slot_radius.resize(j + 1, 0.0f);
+  }
+  int64_t key = Key(x, y);
+  slot_radius[j] = radius;
+  max_radius = std::max(max_radius, radius);
+  if (slot_cell[j] == key) { return; }
+
+  Remove(j);
+  auto& cell = cells[key];
+  slot_cell[j] = key;
+  slot_index[j] = cell.size();
+  cell.push_back(j);
+}
+
+
+// Forget the slots from n on, after the number of sprites drops
+void SpriteGrid::Truncate(int n) {
+  for (int j = n; j < int(slot_cell.size()); j++) {
+    Remove(j);
+  }
+  if (n < int(slot_cell.size())) {
+    slot_cell.resize(n);
+    slot_index.resize(n);
+    slot_radius.resize(n);
+  }
+}
+
+
+void SpriteGrid::Remove(int j) {
+  if (j >= int(slot_cell.size()) || slot_cell[j] == NO_CELL) { return; }
+  auto c = cells.find(slot_cell[j]);
+  auto& cell = c->second;
+  // Move the last sprite in the cell into the removed sprite's place
+  int moved = cell.back();
+  cell[slot_index[j]] = moved;
+  slot_index[moved] = slot_index[j];
+  cell.pop_back();
+  if (cell.empty()) { cells.erase(c); }
+  slot_cell[j] = NO_CELL;
+  slot_index[j] = -1;
+}
+
+
+float RenderSpritesImpl::ImageRadius(int image_id) {
+  if (image_id >= int(image_radius.size())) {
+    image_radius.resize(image_id + 1, -1.0f);
+  }
+  float& radius = image_radius[image_id];
+  if (radius < 0.0f) {
+    const SpriteLocation& loc = Location(image_id);
+    radius = std::max(std::max(std::hypot(loc.x0, loc.y0), std::hypot(loc.x1, loc.y0)),
+                      std::max(std::hypot(loc.x0, loc.y1), std::hypot(loc.x1, loc.y1)));
+  }
+  return radius;
+}
+
+
+void RenderSpritesImpl::UpdateGrid() {
+  int N = sprites.size();
+  if (grid_needs_rebuild) {
+    grid.Clear();
+    for (int j = 0; j < N; j++) {
+      if (!is_free[j]) { InsertIntoGrid(j); }
+    }
+    grid_needs_rebuild = false;
+  }
+
+  // The sprites that changed since the last frame move in the grid
+  // once. They're expanded when FindVisible finds them in the view,
+  // which might not be this frame.
+  for (int j : changed) {
+    if (j >= N) { continue; }
+    if (is_free[j]) {
+      grid.Remove(j);
+    } else {
+      InsertIntoGrid(j);
+    }
+    is_changed[j] = false;
+    is_stale[j] = true;
+  }
+  changed.clear();
+
+  // Moving sprites have to be moved in the grid every frame; the
+  // ones that only spin or change frames stay where they are
+  for (int j : animated) {
     const Sprite& S = sprites[j];
-    SpriteLocation loc = self->atlas.GetLocation(S.image_id);
-    int i = j * 4;
-    vertices[i].corner[0] = loc.x0 * S.scale;
-    vertices[i].corner[1] = loc.y0 * S.scale;
-    vertices[i].texcoord[0] = loc.s0;
-    vertices[i].texcoord[1] = loc.t0;
-    i++;
-    vertices[i].corner[0] = loc.x1 * S.scale;
-    vertices[i].corner[1] = loc.y0 * S.scale;
-    vertices[i].texcoord[0] = loc.s1;
-    vertices[i].texcoord[1] = loc.t0;
-    i++;
-    vertices[i].corner[0] = loc.x0 * S.scale;
-    vertices[i].corner[1] = loc.y1 * S.scale;
-    vertices[i].texcoord[0] = loc.s0;
-    vertices[i].texcoord[1] = loc.t1;
-    i++;
-    vertices[i].corner[0] = loc.x1 * S.scale;
-    vertices[i].corner[1] = loc.y1 * S.scale;
-    vertices[i].texcoord[0] = loc.s1;
-    vertices[i].texcoord[1] = loc.t1;
-  }
-
-  for (int i = 0; i < N * 4; i++) {
-    int j = i / 4;
-    vertices[i].position[0] = sprites[j].x;
-    vertices[i].position[1] = sprites[j].y;
-    vertices[i].rotation = sprites[j].rotation_degrees / DEG_TO_RAD;
+    if (std::abs(S.vx) > 0.0f || std::abs(S.vy) > 0.0f) { InsertIntoGrid(j); }
   }
+}
+
+
+void RenderSpritesImpl::InsertIntoGrid(int j) {
+  const Sprite& S = sprites[j];
+  float x, y;
+  Position(j, &x, &y);
+  grid.Insert(j, x, y, std::abs(S.scale) * ImageRadius(S.image_id));
+}
+
+
+void RenderSpritesImpl::Position(int j, float* x, float* y) const {
+  const Sprite& S = sprites[j];
+  *x = S.x;
+  *y = S.y;
+  if (j < int(animated_index.size()) && animated_index[j] >= 0) {
+    *x += S.vx * (time - S.start_time);
+    *y += S.vy * (time - S.start_time);
+  }
+}
+
+
+void RenderSpritesImpl::FindVisible(float left, float top, float right, float bottom) {
+  visible.clear();
+  auto test_cell = [&](const std::vector<int>& cell) {
+    for (int j : cell) {
+      // Distance from the sprite center to the nearest point of the view
+      float x, y;
+      Position(j, &x, &y);
+      float dx = x - std::min(std::max(x, left), right);
+      float dy = y - std::min(std::max(y, top), bottom);
+      float radius = grid.slot_radius[j];
+      if (dx * dx + dy * dy <= radius * radius) {
+        visible.push_back(j);
+        if (is_stale[j]) {
+          is_stale[j] = false;
+          MarkChanged(j);
+        }
+      }
+    }
+  };
   
-  indices.resize(N * 6);
-  for (int i = 0; i < N * 6; i++) {
+  float margin = grid.max_radius;
+  double ix0 = std::floor((left - margin) / grid.cell_size);
+  double ix1 = std::floor((right + margin) / grid.cell_size);
+  double iy0 = std::floor((top - margin) / grid.cell_size);
+  double iy1 = std::floor((bottom + margin) / grid.cell_size);
+  if ((ix1 - ix0 + 1) * (iy1 - iy0 + 1) > double(grid.cells.size())) {
+    // Zoomed out far enough that it's faster to look at every cell
+    for (const auto& cell : grid.cells) {
+      test_cell(cell.second);
+    }
+  } else {
+    for (double ix = ix0; ix <= ix1; ix++) {
+      for (double iy = iy0; iy <= iy1; iy++) {
+        auto cell = grid.cells.find(SpriteGrid::Key(int32_t(ix), int32_t(iy)));
+        if (cell != grid.cells.end()) { test_cell(cell->second); }
+      }
+    }
+  }
+
+  // Draw in the same order as without culling
+  std::sort(visible.begin(), visible.end());
+}
+
+
+void RenderSpritesImpl::UploadIndices(int capacity) {
+  std::vector<GLubyte> indices(capacity * 6 * (uint_indices? sizeof(GLuint) : sizeof(GLushort)));
+  for (int i = 0; i < capacity * 6; i++) {
     int j = i / 6;
-    indices[i] = j * 4 + corner_index[i % 6];
+    if (uint_indices) {
+      reinterpret_cast<GLuint*>(indices.data())[i] = j * 4 + corner_index[i % 6];
+    } else {
+      reinterpret_cast<GLushort*>(indices.data())[i] = j * 4 + corner_index[i % 6];
+    }
   }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_index.id);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size(), indices.data(), GL_STATIC_DRAW);
+  index_capacity = capacity;
+}
+
+
+void RenderSpritesImpl::UploadDrawListIndices() {
+  // A new run starts whenever the page changes. Without 32-bit
+  // indices, a new run also starts whenever the batch changes, and
+  // the indices are relative to the start of the batch.
+  bool upload = draw_list != uploaded_draw_list;
+  runs.clear();
+  std::vector<GLuint> indices32;
+  std::vector<GLushort> indices16;
+  for (int j : draw_list) {
+    int page = Location(sprites[j].image_id).page;
+    int first_vertex = uint_indices? 0 : (j / SPRITES_PER_BATCH) * SPRITES_PER_BATCH * 4;
+    if (runs.empty() || runs.back().page != page || runs.back().first_vertex != first_vertex) {
+      int first_index = runs.empty()? 0 : runs.back().first_index + runs.back().count;
+      runs.push_back(DrawRun{page, first_vertex, first_index, 0});
+    }
+    for (int k = 0; upload && k < 6; k++) {
+      if (uint_indices) {
+        indices32.push_back(j * 4 + corner_index[k]);
+      } else {
+        indices16.push_back(j * 4 - first_vertex + corner_index[k]);
+      }
+    }
+    runs.back().count += 6;
+  }
+
+  // The view and the sort order often don't change from one frame to
+  // the next, and then the index buffer doesn't need to change
+  if (!upload) { return; }
+  uploaded_draw_list = draw_list;
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_draw_list_index.id);
+  if (uint_indices) {
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices32.size(),
+                 indices32.data(), GL_STREAM_DRAW);
+  } else {
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * indices16.size(),
+                 indices16.data(), GL_STREAM_DRAW);
+  }
+}
+
+
+void RenderSpritesImpl::UploadDrawListInstances(bool list_changed) {
+  // Each run is a range of the draw list with the same page
+  if (list_changed) {
+    runs.clear();
+    for (int i = 0; i < int(draw_list.size()); i++) {
+      int page = Location(sprites[draw_list[i]].image_id).page;
+      if (runs.empty() || runs.back().page != page) {
+        runs.push_back(DrawRun{page, i, 0, 0});
+      }
+      runs.back().count++;
+    }
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_draw_list_instances.id);
+  if (!list_changed || draw_list == uploaded_draw_list) {
+    // Same order as in the buffer, so I only copy the changed records.
+    // A position is only trusted if the draw list still has the slot
+    // there; slots that left the list keep their old positions.
+    std::vector<int> positions;
+    int N = std::min(sprites.size(), draw_list_position.size());
+    for (auto range : dirty) {
+      for (int j = range.begin; j < std::min(range.end, N); j++) {
+        int i = draw_list_position[j];
+        if (i >= 0 && i < int(draw_list.size()) && draw_list[i] == j) {
+          draw_list_instances[i] = instances[j];
+          positions.push_back(i);
+        }
+      }
+    }
+    std::sort(positions.begin(), positions.end());
+    for (size_t k = 0; k < positions.size(); ) {
+      int begin = positions[k], end = begin + 1;
+      for (k++; k < positions.size() && positions[k] <= end + MERGE_GAP; k++) {
+        end = positions[k] + 1;
+      }
+      glBufferSubData(GL_ARRAY_BUFFER,
+                      sizeof(Instance) * begin,
+                      sizeof(Instance) * (end - begin),
+                      draw_list_instances.data() + begin);
+    }
+    return;
+  }
+
+  uploaded_draw_list = draw_list;
+  draw_list_instances.resize(draw_list.size());
+  if (draw_list_position.size() < sprites.size()) {
+    draw_list_position.resize(sprites.size(), -1);
+  }
+  for (int i = 0; i < int(draw_list.size()); i++) {
+    draw_list_instances[i] = instances[draw_list[i]];
+    draw_list_position[draw_list[i]] = i;
+  }
+  glBufferData(GL_ARRAY_BUFFER, sizeof(Instance) * draw_list_instances.size(),
+               draw_list_instances.data(), GL_STREAM_DRAW);
+}
+
+
+void RenderSpritesImpl::UploadVertices(bool reset) {
+  // Each sprite is either four vertices or one instance
+  int N = sprites.size();
+  size_t sprite_size = instanced? sizeof(Instance) : sizeof(Attributes) * 4;
+  const GLubyte* data = instanced? reinterpret_cast<const GLubyte*>(instances.data())
+    : reinterpret_cast<const GLubyte*>(vertices.data());
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_attributes.id);
+  if (attributes_stale) {
+    // Skipped while the draw list's buffer was drawn from
+    attributes_stale = false;
+    dirty.clear();
+    dirty.push_back(SpriteRange{0, N});
+  }
+  if (reset || N > vertex_capacity) {
+    // Leave room to grow so that adding a few sprites doesn't
+    // reallocate the buffer every frame
+    vertex_capacity = std::max(N, vertex_capacity + vertex_capacity / 2);
+    glBufferData(GL_ARRAY_BUFFER,
+                 sprite_size * vertex_capacity,
+                 nullptr,
+                 GL_DYNAMIC_DRAW);
+    dirty.clear();
+    dirty.push_back(SpriteRange{0, N});
+  }
+  
+  for (auto range : dirty) {
+    range.end = std::min(range.end, N);
+    if (range.begin >= range.end) { continue; }
+    glBufferSubData(GL_ARRAY_BUFFER,
+                    sprite_size * range.begin,
+                    sprite_size * (range.end - range.begin),
+                    data + sprite_size * range.begin);
+  }
+  dirty.clear();
+}
+
+
+void RenderSpritesImpl::SetAttribPointers(int first_vertex) {
+  const char* base = reinterpret_cast<const char*>(sizeof(Attributes) * first_vertex);
+  glVertexAttribPointer(loc_a_position,
+                        2, GL_FLOAT, GL_FALSE, sizeof(Attributes),
+                        base + offsetof(Attributes, position));
+  glVertexAttribPointer(loc_a_texcoord,
+                        2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(Attributes),
+                        base + offsetof(Attributes, texcoord));
+}
+
+
+void RenderSpritesImpl::SetInstancePointers(int first_instance) {
+  const char* base = reinterpret_cast<const char*>(sizeof(Instance) * first_instance);
+  glVertexAttribPointer(loc_a_center,
+                        2, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                        base + offsetof(Instance, center));
+  glVertexAttribPointer(loc_a_rotation,
+                        2, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                        base + offsetof(Instance, rotation));
+  glVertexAttribPointer(loc_a_bounds,
+                        4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                        base + offsetof(Instance, bounds));
+  glVertexAttribPointer(loc_a_texcoords,
+                        4, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(Instance),
+                        base + offsetof(Instance, texcoord));
+  glVertexAttribPointer(loc_a_velocity,
+                        2, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                        base + offsetof(Instance, velocity));
+  glVertexAttribPointer(loc_a_animation,
+                        4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                        base + offsetof(Instance, animation));
+  glVertexAttribPointer(loc_a_frame_width,
+                        1, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                        base + offsetof(Instance, frame_width));
+}
+
+
+void RenderSpritesImpl::DrawInstanced(bool use_draw_list) {
+  // The divisor is global state like the enabled attribs, so I set it
+  // back to 0 when I'm done, for the other shader programs
+  GLint per_instance[7] = { loc_a_center, loc_a_rotation, loc_a_bounds, loc_a_texcoords,
+                            loc_a_velocity, loc_a_animation, loc_a_frame_width };
+  glEnableVertexAttribArray(loc_a_corner);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_quad.id);
+  glVertexAttribPointer(loc_a_corner, 2, GL_UNSIGNED_BYTE, GL_FALSE, 0, nullptr);
+  for (GLint loc : per_instance) {
+    glEnableVertexAttribArray(loc);
+    instancing.VertexAttribDivisor(loc, 1);
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER,
+               use_draw_list? vbo_draw_list_instances.id : vbo_attributes.id);
+  int bound_page = -1;
+  for (const auto& run : runs) {
+    if (run.page >= int(textures.size())) { continue; }
+    if (run.page != bound_page) {
+      glBindTexture(GL_TEXTURE_2D, textures[run.page]->id);
+      bound_page = run.page;
+    }
+    SetInstancePointers(run.first_vertex);
+    instancing.DrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, run.count);
+  }
+
+  for (GLint loc : per_instance) {
+    instancing.VertexAttribDivisor(loc, 0);
+    glDisableVertexAttribArray(loc);
+  }
+  glDisableVertexAttribArray(loc_a_corner);
+  GLERRORS("draw instanced");
+}
+
+
+void RenderSpritesImpl::DrawElements(bool use_draw_list) {
+  glEnableVertexAttribArray(loc_a_position);
+  glEnableVertexAttribArray(loc_a_texcoord);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,
+               use_draw_list? vbo_draw_list_index.id : vbo_index.id);
+  GLenum index_type = uint_indices? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+  size_t index_size = uint_indices? sizeof(GLuint) : sizeof(GLushort);
+  int bound_page = -1;
+  for (const auto& run : runs) {
+    if (run.page >= int(textures.size())) { continue; }
+    if (run.page != bound_page) {
+      glBindTexture(GL_TEXTURE_2D, textures[run.page]->id);
+      bound_page = run.page;
+    }
+    // Tell the shader program where to find each of the input variables
+    // ("attributes") in its vertex shader input.
+    SetAttribPointers(run.first_vertex);
+    glDrawElements(GL_TRIANGLES, run.count, index_type,
+                   reinterpret_cast<const GLvoid*>(index_size * run.first_index));
+  }
+  glDisableVertexAttribArray(loc_a_texcoord);
+  glDisableVertexAttribArray(loc_a_position);
+  GLERRORS("draw arrays");
 }
 
   
 void RenderSprites::Render(SDL_Window* window, bool reset) {
-  glUseProgram(self->shader.id);
+  bool instanced = self->instanced;
+  glUseProgram(instanced? self->instanced_shader->id : self->shader.id);
   glEnable(GL_BLEND);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   GLERRORS("useProgram");
 
   // The uniforms are data that will be the same for all records. The
-  // attributes are data in each record. TODO: export camera
-  glUniform2f(self->loc_u_camera_position, 0, 0);
+  // attributes are data in each record.
+  glUniform2f(instanced? self->loc_i_camera_position : self->loc_u_camera_position,
+              self->camera_x, self->camera_y);
 
   // Rescale from world coordinates to OpenGL coordinates. We can
   // either choose for the world coordinates to have Y increasing
@@ -165,64 +1364,105 @@ void RenderSprites::Render(SDL_Window* window, bool reset) {
   int sdl_window_width, sdl_window_height;
   SDL_GL_GetDrawableSize(window, &sdl_window_width, &sdl_window_height);
   float sdl_window_size = std::min(sdl_window_height, sdl_window_width);
-  glUniform2f(self->loc_u_camera_scale,
-              sdl_window_size / sdl_window_width,
-              -sdl_window_size / sdl_window_height);
+  float scale_x = self->camera_zoom * sdl_window_size / sdl_window_width;
+  float scale_y = self->camera_zoom * sdl_window_size / sdl_window_height;
+  glUniform2f(instanced? self->loc_i_camera_scale : self->loc_u_camera_scale,
+              scale_x, -scale_y);
   
   GLERRORS("glUniform2f");
 
   // Textures have an id and also a register (0 in this
-  // case). We have to bind register 0 to the texture id:
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, self->texture.id);
+  // case). Each draw run binds its page's texture id to register 0,
   // and then we have to tell the shader which register (0) to use:
-  glUniform1i(self->loc_u_texture, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glUniform1i(instanced? self->loc_i_texture : self->loc_u_texture, 0);
+  if (instanced) {
+    glUniform1f(self->loc_i_time, self->time);
+  } else {
+    // Without the instanced shader, animated sprites change every frame
+    for (int j : self->animated) {
+      self->MarkChanged(j);
+    }
+  }
   // It might be ok to hard-code the register number inside the shader.
   
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, self->vbo_index.id);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-               sizeof(GLushort) * self->indices.size(),
-               self->indices.data(),
-               GL_DYNAMIC_DRAW);
-
-  // Tell the shader program where to find each of the input variables
-  // ("attributes") in its vertex shader input.
-  glBindBuffer(GL_ARRAY_BUFFER, self->vbo_attributes.id);
-  glBufferData(GL_ARRAY_BUFFER,
-               sizeof(Attributes) * self->vertices.size(),
-               self->vertices.data(),
-               GL_STREAM_DRAW);
-  
-  glVertexAttribPointer(self->loc_a_corner,
-                        2, GL_FLOAT, GL_FALSE, sizeof(Attributes),
-                        reinterpret_cast<GLvoid*>(offsetof(Attributes, corner)));
-  glVertexAttribPointer(self->loc_a_texcoord,
-                        2, GL_FLOAT, GL_FALSE, sizeof(Attributes),
-                        reinterpret_cast<GLvoid*>(offsetof(Attributes, texcoord)));
-  glVertexAttribPointer(self->loc_a_position,
-                        2, GL_FLOAT, GL_FALSE, sizeof(Attributes),
-                        reinterpret_cast<GLvoid*>(offsetof(Attributes, position)));
-  glVertexAttribPointer(self->loc_a_rotation,
-                        1, GL_FLOAT, GL_FALSE, sizeof(Attributes),
-                        reinterpret_cast<GLvoid*>(offsetof(Attributes, rotation)));
+  self->UploadPages();
+  if (self->culling) {
+    // The view covers -1 to +1 in OpenGL coordinates
+    self->UpdateGrid();
+    self->FindVisible(self->camera_x - 1.0f / scale_x, self->camera_y - 1.0f / scale_y,
+                      self->camera_x + 1.0f / scale_x, self->camera_y + 1.0f / scale_y);
+  }
+  self->ExpandChanged();
   
-  GLERRORS("glVertexAttribPointer");
+  int N = self->sprites.size();
+  bool use_draw_list = self->culling || self->key_counts.size() > 1;
+  if (reset) {
+    self->uploaded_draw_list.clear();
+    self->draw_list_dirty = true;
+  }
+  // With culling, the draw list is the visible sprites, so it's made
+  // every frame; otherwise only when the sort order changes
+  bool draw_list_changed = use_draw_list && (self->culling || self->draw_list_dirty);
+  if (draw_list_changed) {
+    self->BuildDrawList();
+    self->draw_list_dirty = false;
+  }
+  if (!use_draw_list) {
+    // The runs below replace the draw list's runs
+    self->draw_list_dirty = true;
+  }
+  if (instanced) {
+    if (use_draw_list) {
+      self->UploadDrawListInstances(draw_list_changed);
+    } else {
+      int page = self->key_counts.empty()? 0 : (self->key_counts.begin()->first & 0xffff);
+      self->runs.clear();
+      self->runs.push_back(DrawRun{page, 0, 0, N});
+    }
+  } else if (use_draw_list) {
+    if (draw_list_changed) { self->UploadDrawListIndices(); }
+  } else {
+    int index_capacity = self->uint_indices? N : std::min(N, SPRITES_PER_BATCH);
+    if (reset || index_capacity > self->index_capacity) {
+      if (!reset) {
+        index_capacity = std::max(index_capacity, self->index_capacity * 2);
+      }
+      if (!self->uint_indices) {
+        index_capacity = std::min(index_capacity, SPRITES_PER_BATCH);
+      }
+      self->UploadIndices(index_capacity);
+    }
+
+    // Every batch uses the same part of the static index buffer.
+    // All the sprites are on the same page.
+    self->runs.clear();
+    int page = self->key_counts.empty()? 0 : (self->key_counts.begin()->first & 0xffff);
+    int batch = self->uint_indices? N : SPRITES_PER_BATCH;
+    for (int first = 0; first < N; first += batch) {
+      self->runs.push_back(DrawRun{page, first * 4, 0, 6 * std::min(N - first, batch)});
+    }
+  }
+
+  if (instanced && use_draw_list) {
+    // The changed records are already in the draw list's buffer
+    self->dirty.clear();
+    self->attributes_stale = true;
+    if (reset) { self->vertex_capacity = 0; }
+  } else {
+    self->UploadVertices(reset);
+  }
+  GLERRORS("glBufferSubData");
 
   // Run the shader program. Enable the vertex attribs just while
   // running this program. Which ones are enabled is global state, and
   // we don't want to interfere with any other shader programs we want
   // to run elsewhere.
-  glEnableVertexAttribArray(self->loc_a_corner);
-  glEnableVertexAttribArray(self->loc_a_texcoord);
-  glEnableVertexAttribArray(self->loc_a_position);
-  glEnableVertexAttribArray(self->loc_a_rotation);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, self->vbo_index.id);
-  glDrawElements(GL_TRIANGLES, self->indices.size(), GL_UNSIGNED_SHORT, 0);
-  glDisableVertexAttribArray(self->loc_a_rotation);
-  glDisableVertexAttribArray(self->loc_a_position);
-  glDisableVertexAttribArray(self->loc_a_texcoord);
-  glDisableVertexAttribArray(self->loc_a_corner);
-  GLERRORS("draw arrays");
+  if (instanced) {
+    self->DrawInstanced(use_draw_list);
+  } else {
+    self->DrawElements(use_draw_list);
+  }
 
   glDisable(GL_BLEND);
 }
@@ -5,17 +5,31 @@
 #define RENDER_SPRITES_H
 
 #include "render-layer.h"
+#include "atlas.h"
 #include <memory>
+#include <string>
 #include <vector>
 
 struct SDL_Window;
 struct RenderSpritesImpl;
+class WorkerPool;
 
 const float DEG_TO_RAD = 3.141592653589793f / 180.0f;
 
 struct Sprite {
   int image_id;
   float x, y, rotation_degrees, scale;
+  int depth = 0; // higher depths are drawn on top; -32768 to 32767
+
+  // Animation, evaluated when drawing at the time given to SetTime.
+  // The sprite moves by vx,vy and turns by angular_velocity (same
+  // units as rotation_degrees) per second since start_time. If the
+  // image is a sprite sheet, it shows num_frames frames starting at
+  // first_frame, frame_rate frames per second.
+  float vx = 0.0f, vy = 0.0f, angular_velocity = 0.0f;
+  float start_time = 0.0f;
+  int first_frame = 0, num_frames = 1;
+  float frame_rate = 0.0f;
 };
 
 
@@ -25,7 +39,69 @@ public:
   ~RenderSprites();
   virtual void Render(SDL_Window* window, bool reset);
 
+  // Images are packed into atlas pages. Each page is one texture and
+  // one draw call per depth. A sprite sheet has its frames side by
+  // side, all the same width. Returns the image id for use in Sprite.
+  int LoadImage(const char* filename, int frames = 1);
+
+  // Load many images at once, decoding them on the worker pool.
+  // Returns the image ids, in the same order as the filenames.
+  std::vector<int> LoadImages(const std::vector<std::string>& filenames);
+
+  // Use the images from a file made by atlas-bake instead of loading
+  // them one at a time. Call this before LoadImage. The image ids are
+  // in the order they were baked. Returns false if the file is
+  // missing or not a baked atlas.
+  bool LoadBakedAtlas(const char* path);
+
+  // Free the atlas surfaces after they're uploaded, to save memory
+  // when there are many images. Rebuilding the atlas then has to read
+  // the images again. They're freed after the next Render.
+  void SetReleaseSurfaces(bool release);
+
+  // How full the atlas pages are, for choosing image sizes
+  AtlasStats GetAtlasStats() const;
+
+  // Store the atlas pages in a smaller format on the GPU. RGBA4444
+  // and RGB565 halve the texture memory; dithering hides the banding.
+  void SetTextureFormat(TextureFormat format, bool dither = false);
+
+  // Sprites are kept from frame to frame. Create returns an id to
+  // use for Update and Destroy. Ids of destroyed sprites get reused;
+  // updating or destroying a destroyed id is an error.
+  int CreateSprite(const Sprite& sprite);
+  void UpdateSprite(int id, const Sprite& sprite);
+  void DestroySprite(int id);
+
+  // Replace all the sprites; sprite j gets id j. Ids from
+  // CreateSprite are no longer valid afterwards.
   void SetSprites(const std::vector<Sprite>& sprites);
+
+  // Use these threads to expand large numbers of changed sprites into
+  // vertices, and to decode images in LoadImages. The pool has to
+  // outlive the layer. nullptr means to use only the calling thread,
+  // which is the default.
+  void SetWorkerPool(WorkerPool* workers);
+
+  // Instancing is used by default when the GL context has it. This
+  // switches to the vertex expansion path and back, for comparing
+  // them. Returns whether instancing is in use.
+  bool SetInstancing(bool enabled);
+
+  // Time in seconds for the sprite animations. With instancing,
+  // animated sprites cost nothing on the cpu; without it, they're
+  // expanded again every frame.
+  void SetTime(float seconds);
+
+  // Center the view on world position x,y. At zoom 1, world
+  // coordinates -1 to +1 fill the smaller window dimension.
+  void SetCamera(float x, float y, float zoom = 1.0f);
+
+  // With culling, only the sprites whose bounding circle overlaps
+  // the view are expanded, uploaded, and drawn. Sprites are kept in a
+  // grid with cells cell_size world units across, which works best
+  // when it's a few times the size of a typical sprite.
+  void SetCulling(bool enabled, float cell_size = 1.0f);
   
 protected:
   std::unique_ptr<RenderSpritesImpl> self;
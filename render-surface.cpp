@@ -3,33 +3,70 @@
 
 #include "render-surface.h"
 #include "window.h"
+#include "common.h"
 
 #include <SDL.h>
 #include <SDL_image.h>
 #include "glwrappers.h"
 
+#include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <vector>
 
 
+// The surface is split into tiles. Only tiles with something visible
+// in them are copied to the texture and drawn; fully transparent ones
+// cost nothing. The texture holds the visible tiles in slots, in any
+// order, and grows a row of slots at a time as more tiles are needed.
+// Each slot has a gutter around the tile with the pixels next to it
+// in the surface, so that linear filtering at the edge of a tile
+// blends with its real neighbors instead of another slot.
+namespace {
+  const int TILE_SIZE = 256;
+  const int SLOT_SIZE = TILE_SIZE + 2; // with a one pixel gutter
+}
+
+struct Tile {
+  SDL_Rect rect;  // the part of the surface it covers
+  bool dirty;     // changed since it was last copied
+  int slot;       // where it is in the texture, or -1 if it's transparent
+};
+
 struct RenderSurfaceImpl {
   SDL_Surface* surface;
   ShaderProgram shader;
   VertexBuffer vbo_pos;
   VertexBuffer vbo_tex;
   Texture texture;
-  
+
+  int tile_columns, tile_rows;
+  std::vector<Tile> tiles;
+  std::vector<int> free_slots;
+  int slot_rows;          // the texture is tile_columns x slot_rows slots
+  int texture_slot_rows;  // slot rows in the texture made on the GPU, 0 if none yet
+  bool quads_changed;
+  int num_vertices;
+  int version;
+
   GLint loc_u_texture;
   GLint loc_a_position;
   GLint loc_a_texcoord;
 
   RenderSurfaceImpl(SDL_Surface* surface);
+  bool IsTransparent(const SDL_Rect& rect) const;
+  int AllocateSlot();
+  SDL_Point SlotPosition(int slot) const;
+  void CopyTile(const Tile& tile);
+  void UpdateTiles(bool reset);
+  void BuildQuads();
 };
 
 
 RenderSurface::RenderSurface(SDL_Surface* surface): self(new RenderSurfaceImpl(surface)) {}
 RenderSurface::~RenderSurface() {}
 
-// Shader program for drawing a single quad
+// Shader program for drawing the tiles as quads
 namespace {
   GLchar vertex_shader[] = R"(
   attribute vec2 a_position;
@@ -48,51 +85,237 @@ namespace {
     gl_FragColor = texture2D(u_texture, v_texcoord);
   }
 )";
-
-  // The positions (0-1) is the region of the screen to draw to, and
-  // the texcoords (0-1) is the region of the surface to draw. Note
-  // that texcoords are Y-axis-down and positions are Y-axis-up.
-  GLfloat position[] = { 0, 1, 1, 1, 0, 0, 1, 0 };
-  GLfloat texcoord[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
 }
 
 
 RenderSurfaceImpl::RenderSurfaceImpl(SDL_Surface* surface_)
-  :surface(surface_), shader(vertex_shader, fragment_shader)
+  :surface(surface_), shader(vertex_shader, fragment_shader),
+   slot_rows(0), texture_slot_rows(0), quads_changed(true), num_vertices(0), version(1)
 {
+  if (surface->format->BytesPerPixel != 4) { FAIL("RenderSurface needs a 32-bit surface"); }
+
   loc_u_texture = glGetUniformLocation(shader.id, "u_texture");
   loc_a_position = glGetAttribLocation(shader.id, "a_position");
   loc_a_texcoord = glGetAttribLocation(shader.id, "a_texcoord");
+
+  tile_columns = (surface->w + TILE_SIZE - 1) / TILE_SIZE;
+  tile_rows = (surface->h + TILE_SIZE - 1) / TILE_SIZE;
+  for (int row = 0; row < tile_rows; row++) {
+    for (int col = 0; col < tile_columns; col++) {
+      Tile tile;
+      tile.rect.x = col * TILE_SIZE;
+      tile.rect.y = row * TILE_SIZE;
+      tile.rect.w = std::min(TILE_SIZE, surface->w - tile.rect.x);
+      tile.rect.h = std::min(TILE_SIZE, surface->h - tile.rect.y);
+      tile.dirty = true;
+      tile.slot = -1;
+      tiles.push_back(tile);
+    }
+  }
+}
+
+
+bool RenderSurfaceImpl::IsTransparent(const SDL_Rect& rect) const {
+  Uint32 alpha_mask = surface->format->Amask;
+  if (alpha_mask == 0) { return false; }
+  for (int y = rect.y; y < rect.y + rect.h; y++) {
+    const Uint8* row = static_cast<const Uint8*>(surface->pixels) + y * surface->pitch;
+    for (int x = rect.x; x < rect.x + rect.w; x++) {
+      Uint32 pixel;
+      memcpy(&pixel, row + 4 * x, 4);
+      if ((pixel & alpha_mask) != 0) { return false; }
+    }
+  }
+  return true;
+}
+
+
+int RenderSurfaceImpl::AllocateSlot() {
+  if (free_slots.empty()) {
+    // There can't be more visible tiles than tiles, so the texture
+    // never needs more rows of slots than there are rows of tiles
+    for (int col = tile_columns - 1; col >= 0; col--) {
+      free_slots.push_back(slot_rows * tile_columns + col);
+    }
+    slot_rows++;
+  }
+  int slot = free_slots.back();
+  free_slots.pop_back();
+  return slot;
+}
+
+
+// The corner of the tile in the texture, inside the gutter
+SDL_Point RenderSurfaceImpl::SlotPosition(int slot) const {
+  return SDL_Point{(slot % tile_columns) * SLOT_SIZE + 1, (slot / tile_columns) * SLOT_SIZE + 1};
+}
+
+
+void RenderSurfaceImpl::CopyTile(const Tile& tile) {
+  SDL_Point corner = SlotPosition(tile.slot);
+  SDL_Rect bounds{0, 0, surface->w, surface->h};
+
+  // The tile and the pixels around it, as far as the surface goes
+  SDL_Rect outer{tile.rect.x - 1, tile.rect.y - 1, tile.rect.w + 2, tile.rect.h + 2};
+  SDL_Rect rect;
+  SDL_IntersectRect(&outer, &bounds, &rect);
+  texture.CopyRectFromSurface(surface, rect, corner.x + rect.x - tile.rect.x,
+                              corner.y + rect.y - tile.rect.y);
+
+  // Past the edge of the surface, the gutter repeats the edge pixels,
+  // like GL_CLAMP_TO_EDGE does for a whole texture
+  bool left = rect.x == tile.rect.x, right = rect.x + rect.w == tile.rect.x + tile.rect.w;
+  bool top = rect.y == tile.rect.y, bottom = rect.y + rect.h == tile.rect.y + tile.rect.h;
+  int dest_y = corner.y + rect.y - tile.rect.y;
+  if (left) {
+    texture.CopyRectFromSurface(surface, SDL_Rect{rect.x, rect.y, 1, rect.h},
+                                corner.x - 1, dest_y);
+  }
+  if (right) {
+    texture.CopyRectFromSurface(surface, SDL_Rect{rect.x + rect.w - 1, rect.y, 1, rect.h},
+                                corner.x + tile.rect.w, dest_y);
+  }
+  int dest_x = corner.x + rect.x - tile.rect.x;
+  auto copy_row = [&](int src_y, int y) {
+    texture.CopyRectFromSurface(surface, SDL_Rect{rect.x, src_y, rect.w, 1}, dest_x, y);
+    if (left) {
+      texture.CopyRectFromSurface(surface, SDL_Rect{rect.x, src_y, 1, 1}, corner.x - 1, y);
+    }
+    if (right) {
+      texture.CopyRectFromSurface(surface, SDL_Rect{rect.x + rect.w - 1, src_y, 1, 1},
+                                  corner.x + tile.rect.w, y);
+    }
+  };
+  if (top) { copy_row(rect.y, corner.y - 1); }
+  if (bottom) { copy_row(rect.y + rect.h - 1, corner.y + tile.rect.h); }
+}
+
+
+void RenderSurfaceImpl::UpdateTiles(bool reset) {
+  // A tile that's become transparent gives up its slot, and one that's
+  // stopped being transparent gets a slot
+  for (Tile& tile : tiles) {
+    if (!tile.dirty) { continue; }
+    bool transparent = IsTransparent(tile.rect);
+    if (transparent && tile.slot >= 0) {
+      free_slots.push_back(tile.slot);
+      tile.slot = -1;
+      quads_changed = true;
+    } else if (!transparent && tile.slot < 0) {
+      tile.slot = AllocateSlot();
+      quads_changed = true;
+    }
+  }
+
+  // A new or bigger texture starts out empty, so every visible tile
+  // has to be copied into it. The texture isn't made at all until a
+  // tile needs it.
+  if (slot_rows > 0 && (reset || texture_slot_rows != slot_rows)) {
+    texture.CopyFromPixels(tile_columns * SLOT_SIZE, slot_rows * SLOT_SIZE, GL_RGBA, nullptr);
+    texture_slot_rows = slot_rows;
+    quads_changed = true;
+    for (Tile& tile : tiles) {
+      if (tile.slot >= 0) { tile.dirty = true; }
+    }
+  }
+
+  for (Tile& tile : tiles) {
+    if (tile.dirty && tile.slot >= 0) {
+      CopyTile(tile);
+    }
+    tile.dirty = false;
+  }
+}
+
+
+void RenderSurfaceImpl::BuildQuads() {
+  // The positions (0-1) are the region of the screen to draw to, and
+  // the texcoords (0-1) are the region of the texture to draw. Note
+  // that texcoords are Y-axis-down and positions are Y-axis-up.
+  std::vector<GLfloat> position, texcoord;
+  float texture_width = float(tile_columns * SLOT_SIZE);
+  float texture_height = float(texture_slot_rows * SLOT_SIZE);
+  for (const Tile& tile : tiles) {
+    if (tile.slot < 0) { continue; }
+    SDL_Point corner = SlotPosition(tile.slot);
+    float x0 = float(tile.rect.x) / surface->w;
+    float x1 = float(tile.rect.x + tile.rect.w) / surface->w;
+    float y0 = 1.0f - float(tile.rect.y) / surface->h;
+    float y1 = 1.0f - float(tile.rect.y + tile.rect.h) / surface->h;
+    float s0 = corner.x / texture_width;
+    float s1 = (corner.x + tile.rect.w) / texture_width;
+    float t0 = corner.y / texture_height;
+    float t1 = (corner.y + tile.rect.h) / texture_height;
+    GLfloat quad_position[] = { x0, y0, x1, y0, x0, y1,  x0, y1, x1, y0, x1, y1 };
+    GLfloat quad_texcoord[] = { s0, t0, s1, t0, s0, t1,  s0, t1, s1, t0, s1, t1 };
+    position.insert(position.end(), std::begin(quad_position), std::end(quad_position));
+    texcoord.insert(texcoord.end(), std::begin(quad_texcoord), std::end(quad_texcoord));
+  }
+  num_vertices = int(position.size() / 2);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_pos.id);
+  glBufferData(GL_ARRAY_BUFFER, position.size() * sizeof(GLfloat), position.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_tex.id);
+  glBufferData(GL_ARRAY_BUFFER, texcoord.size() * sizeof(GLfloat), texcoord.data(), GL_STATIC_DRAW);
+  quads_changed = false;
+}
+
+
+void RenderSurface::MarkDirty(const SDL_Rect& rect) {
+  SDL_Rect bounds{0, 0, self->surface->w, self->surface->h};
+  // The tiles next to the rect have its edge pixels in their gutters
+  SDL_Rect outer{rect.x - 1, rect.y - 1, rect.w + 2, rect.h + 2};
+  SDL_Rect clipped;
+  if (rect.w <= 0 || rect.h <= 0 || !SDL_IntersectRect(&outer, &bounds, &clipped)) { return; }
+  int col0 = clipped.x / TILE_SIZE, col1 = (clipped.x + clipped.w - 1) / TILE_SIZE;
+  int row0 = clipped.y / TILE_SIZE, row1 = (clipped.y + clipped.h - 1) / TILE_SIZE;
+  for (int row = row0; row <= row1; row++) {
+    for (int col = col0; col <= col1; col++) {
+      self->tiles[row * self->tile_columns + col].dirty = true;
+    }
+  }
+  self->version++;
+}
+
+
+void RenderSurface::MarkDirty() {
+  MarkDirty(SDL_Rect{0, 0, self->surface->w, self->surface->h});
+}
+
+
+int RenderSurface::Version() const {
+  return self->version;
 }
 
 
 void RenderSurface::Render(SDL_Window* window, bool reset) {
+  // When the GL context is new, the texture and buffers are gone
+  if (reset) {
+    for (Tile& tile : self->tiles) { tile.dirty = true; }
+    self->quads_changed = true;
+  }
+  self->UpdateTiles(reset);
+  if (self->quads_changed) { self->BuildQuads(); }
+  if (self->num_vertices == 0) { return; }
+
   glUseProgram(self->shader.id);
   glEnable(GL_BLEND);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-  self->texture.CopyFromSurface(self->surface);
-  
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_2D, self->texture.id);
   glUniform1i(self->loc_u_texture, 0);
-  
-  if (reset) {
-    glBindBuffer(GL_ARRAY_BUFFER, self->vbo_pos.id);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(position), position, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, self->vbo_tex.id);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(texcoord), texcoord, GL_STATIC_DRAW);
-  }
+
   glBindBuffer(GL_ARRAY_BUFFER, self->vbo_pos.id);
   glVertexAttribPointer(self->loc_a_position,
                         2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
   glBindBuffer(GL_ARRAY_BUFFER, self->vbo_tex.id);
   glVertexAttribPointer(self->loc_a_texcoord,
                         2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
-  
+
   glEnableVertexAttribArray(self->loc_a_position);
   glEnableVertexAttribArray(self->loc_a_texcoord);
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  glDrawArrays(GL_TRIANGLES, 0, self->num_vertices);
   glDisableVertexAttribArray(self->loc_a_texcoord);
   glDisableVertexAttribArray(self->loc_a_position);
 
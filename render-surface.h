@@ -9,14 +9,25 @@
 
 struct SDL_Window;
 struct SDL_Surface;
+struct SDL_Rect;
 struct RenderSurfaceImpl;
 
 
 class RenderSurface: public IRenderLayer {
 public:
+  // The surface has to have 32-bit pixels, and outlive the layer
   RenderSurface(SDL_Surface* surface);
   ~RenderSurface();
   virtual void Render(SDL_Window* window, bool reset);
+
+  // The surface is drawn as tiles, and only the tiles marked dirty
+  // are copied to the texture again. Fully transparent tiles aren't
+  // copied or drawn at all, so a mostly empty surface is cheap. The
+  // whole surface starts out dirty. The version goes up with every
+  // change.
+  void MarkDirty(const SDL_Rect& rect);
+  void MarkDirty();
+  int Version() const;
   
 protected:
   std::unique_ptr<RenderSurfaceImpl> self;
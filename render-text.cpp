@@ -0,0 +1,435 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+#include "render-text.h"
+#include "font.h"
+
+#include <SDL.h>
+#include "glwrappers.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+
+namespace {
+
+  struct Attributes {
+    GLfloat position[2]; // drawable pixels
+    GLfloat texcoord[2]; // atlas pixels, so they stay right when it grows
+    GLubyte color[4];
+    GLubyte outline_color[4];
+    GLfloat effects[3];  // scale, outline and glow, for distance fields
+  };
+
+  // All the glyphs for one font are drawn together, from its atlas
+  struct Batch {
+    const Font* font;
+    int first_vertex;
+    int count;
+  };
+
+  struct FontTexture {
+    std::unique_ptr<Texture> texture;
+    int version; // of the atlas when it was copied
+  };
+
+  // Bitmap fonts and distance field fonts have their own programs,
+  // with the same attributes. The bitmap program doesn't use them
+  // all, so some of the locations are -1.
+  struct TextProgram {
+    ShaderProgram shader;
+
+    // Uniforms
+    GLint loc_u_window_size;
+    GLint loc_u_texture_size;
+    GLint loc_u_texture;
+    GLint loc_u_spread;
+
+    // Attributes
+    GLint loc_a_position;
+    GLint loc_a_texcoord;
+    GLint loc_a_color;
+    GLint loc_a_outline_color;
+    GLint loc_a_effects;
+
+    TextProgram(const char* vertex_shader, const char* fragment_shader);
+    void Use(int window_width, int window_height) const;
+    void Unuse() const;
+  };
+
+}
+
+struct RenderTextImpl {
+  std::vector<Label> labels;
+  bool labels_changed;
+
+  // The vertices have to be made again when the labels change, or
+  // when a glyph has been evicted from a font's atlas, which may have
+  // moved one of theirs
+  std::vector<Attributes> vertices;
+  std::vector<Batch> batches;
+  std::unordered_map<const Font*, int> vertex_evictions;
+  std::vector<SDL_Rect> changed_rects;
+  std::vector<Uint8> cell_pixels;
+  std::unordered_map<const Font*, FontTexture> textures;
+
+  TextProgram bitmap_program;
+  TextProgram sdf_program;
+  VertexBuffer vbo;
+
+  RenderTextImpl();
+  bool VerticesChanged() const;
+  void MakeVertices();
+  void AddLabel(const Label& label);
+  void UpdateTexture(const Font* font, bool reset);
+};
+
+
+RenderText::RenderText(): self(new RenderTextImpl) {}
+RenderText::~RenderText() {}
+
+// Shader programs for drawing glyphs from an atlas, tinted
+namespace {
+  GLchar vertex_shader[] = R"(
+  uniform vec2 u_window_size;
+  uniform vec2 u_texture_size;
+  attribute vec2 a_position;
+  attribute vec2 a_texcoord;
+  attribute vec4 a_color;
+  attribute vec4 a_outline_color;
+  attribute vec3 a_effects;
+  varying vec2 v_texcoord;
+  varying vec4 v_color;
+  varying vec4 v_outline_color;
+  varying vec3 v_effects;
+  void main() {
+    vec2 screen_coords = a_position / u_window_size * vec2(2.0, -2.0) + vec2(-1.0, 1.0);
+    gl_Position = vec4(screen_coords, 0.0, 1.0);
+    v_texcoord = a_texcoord / u_texture_size;
+    v_color = a_color;
+    v_outline_color = a_outline_color;
+    v_effects = a_effects;
+  }
+)";
+
+  GLchar bitmap_fragment_shader[] = R"(
+  uniform sampler2D u_texture;
+  varying vec2 v_texcoord;
+  varying vec4 v_color;
+  void main() {
+    gl_FragColor = vec4(v_color.rgb, v_color.a * texture2D(u_texture, v_texcoord).a);
+  }
+)";
+
+  // The distance is in the font's pixels, and the scale turns it into
+  // screen pixels, so the edge is antialiased over one screen pixel at
+  // any scale. The outline and glow go outwards from the edge, and the
+  // glyph is drawn over them.
+  GLchar sdf_fragment_shader[] = R"(
+  uniform sampler2D u_texture;
+  uniform float u_spread;
+  varying vec2 v_texcoord;
+  varying vec4 v_color;
+  varying vec4 v_outline_color;
+  varying vec3 v_effects;
+  void main() {
+    float value = texture2D(u_texture, v_texcoord).a * 255.0;
+    float distance = (value - 128.0) * u_spread / 128.0;
+    float scale = v_effects.x, outline = v_effects.y, glow = v_effects.z;
+    float fill = clamp(distance * scale + 0.5, 0.0, 1.0);
+    float border = clamp((distance + outline) * scale + 0.5, 0.0, 1.0);
+    if (glow > 0.0) {
+      float fade = clamp(1.0 + (distance + outline) / glow, 0.0, 1.0);
+      border = max(border, fade * fade);
+    }
+    float fill_alpha = v_color.a * fill;
+    float border_alpha = v_outline_color.a * border * (1.0 - fill_alpha);
+    float alpha = fill_alpha + border_alpha;
+    vec3 rgb = v_color.rgb * fill_alpha + v_outline_color.rgb * border_alpha;
+    gl_FragColor = vec4(alpha > 0.0? rgb / alpha : v_color.rgb, alpha);
+  }
+)";
+}
+
+
+TextProgram::TextProgram(const char* vertex_shader_, const char* fragment_shader_)
+  :shader(vertex_shader_, fragment_shader_)
+{
+  loc_u_window_size = glGetUniformLocation(shader.id, "u_window_size");
+  loc_u_texture_size = glGetUniformLocation(shader.id, "u_texture_size");
+  loc_u_texture = glGetUniformLocation(shader.id, "u_texture");
+  loc_u_spread = glGetUniformLocation(shader.id, "u_spread");
+  loc_a_position = glGetAttribLocation(shader.id, "a_position");
+  loc_a_texcoord = glGetAttribLocation(shader.id, "a_texcoord");
+  loc_a_color = glGetAttribLocation(shader.id, "a_color");
+  loc_a_outline_color = glGetAttribLocation(shader.id, "a_outline_color");
+  loc_a_effects = glGetAttribLocation(shader.id, "a_effects");
+}
+
+
+namespace {
+  void AttribPointer(GLint location, GLint size, GLenum type, GLboolean normalized, size_t offset) {
+    if (location < 0) { return; }
+    glVertexAttribPointer(location, size, type, normalized, sizeof(Attributes),
+                          reinterpret_cast<GLvoid*>(offset));
+    glEnableVertexAttribArray(location);
+  }
+
+  void DisableAttrib(GLint location) {
+    if (location >= 0) { glDisableVertexAttribArray(location); }
+  }
+}
+
+
+/** Switch to this program, with the vertex buffer already bound. */
+void TextProgram::Use(int window_width, int window_height) const {
+  glUseProgram(shader.id);
+  GLERRORS("useProgram");
+  glUniform2f(loc_u_window_size, float(window_width), float(window_height));
+  glUniform1i(loc_u_texture, 0);
+  AttribPointer(loc_a_position, 2, GL_FLOAT, GL_FALSE, offsetof(Attributes, position));
+  AttribPointer(loc_a_texcoord, 2, GL_FLOAT, GL_FALSE, offsetof(Attributes, texcoord));
+  AttribPointer(loc_a_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(Attributes, color));
+  AttribPointer(loc_a_outline_color, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+                offsetof(Attributes, outline_color));
+  AttribPointer(loc_a_effects, 3, GL_FLOAT, GL_FALSE, offsetof(Attributes, effects));
+  GLERRORS("glVertexAttribPointer");
+}
+
+
+void TextProgram::Unuse() const {
+  DisableAttrib(loc_a_effects);
+  DisableAttrib(loc_a_outline_color);
+  DisableAttrib(loc_a_color);
+  DisableAttrib(loc_a_texcoord);
+  DisableAttrib(loc_a_position);
+}
+
+
+RenderTextImpl::RenderTextImpl()
+  :labels_changed(false),
+   bitmap_program(vertex_shader, bitmap_fragment_shader),
+   sdf_program(vertex_shader, sdf_fragment_shader)
+{
+}
+
+
+namespace {
+  // Bitwise, which is all that matters for whether the vertices
+  // would come out the same
+  bool Same(float a, float b) {
+    return std::memcmp(&a, &b, sizeof(float)) == 0;
+  }
+
+  bool SameLabel(const Label& a, const Label& b) {
+    return a.font == b.font && a.text == b.text
+      && Same(a.x, b.x) && Same(a.y, b.y)
+      && Same(a.r, b.r) && Same(a.g, b.g) && Same(a.b, b.b) && Same(a.a, b.a)
+      && Same(a.scale, b.scale) && Same(a.rotation_degrees, b.rotation_degrees)
+      && Same(a.outline, b.outline) && Same(a.glow, b.glow)
+      && Same(a.outline_r, b.outline_r) && Same(a.outline_g, b.outline_g)
+      && Same(a.outline_b, b.outline_b) && Same(a.outline_a, b.outline_a);
+  }
+}
+
+
+void RenderText::SetLabels(const std::vector<Label>& labels) {
+  // Setting the same labels every frame doesn't make the vertices again
+  if (labels.size() == self->labels.size()
+      && std::equal(labels.begin(), labels.end(), self->labels.begin(), SameLabel)) {
+    return;
+  }
+  self->labels = labels;
+  self->labels_changed = true;
+}
+
+
+bool RenderTextImpl::VerticesChanged() const {
+  if (labels_changed) { return true; }
+  for (const Batch& batch : batches) {
+    if (batch.font->Evictions() != vertex_evictions.at(batch.font)) { return true; }
+  }
+  return false;
+}
+
+
+namespace {
+  GLubyte ColorByte(float value) {
+    return GLubyte(std::lround(255 * std::min(std::max(value, 0.0f), 1.0f)));
+  }
+}
+
+
+/** Six vertices per glyph, transformed on the CPU, so that all the
+ * labels for a font can go in one draw call.
+ */
+void RenderTextImpl::AddLabel(const Label& label) {
+  GLubyte color[4] = {
+    ColorByte(label.r), ColorByte(label.g), ColorByte(label.b), ColorByte(label.a)
+  };
+  GLubyte outline_color[4] = {
+    ColorByte(label.outline_r), ColorByte(label.outline_g),
+    ColorByte(label.outline_b), ColorByte(label.outline_a)
+  };
+  // The distance field doesn't reach past the spread, so neither can
+  // the outline and glow
+  float spread = float(label.font->SDFSpread());
+  float outline = std::min(std::max(label.outline, 0.0f), spread);
+  float glow = std::min(std::max(label.glow, 0.0f), spread - outline);
+  float radians = label.rotation_degrees * (3.141592653589793f / 180.0f);
+  float cos_scaled = label.scale * std::cos(radians);
+  float sin_scaled = label.scale * std::sin(radians);
+
+  for (const GlyphQuad& quad : label.font->Layout(label.text.c_str()).glyphs) {
+    SDL_Rect rect = label.font->GlyphRect(quad.codepoint);
+    // Whole pixels, as in Font::Draw, so that untransformed text is sharp
+    float x0 = std::floor(quad.x0), y0 = quad.y0;
+    float x1 = x0 + rect.w, y1 = y0 + rect.h;
+    const float corners[6][2] = {{x0, y0}, {x1, y0}, {x0, y1}, {x0, y1}, {x1, y0}, {x1, y1}};
+    for (const auto& corner : corners) {
+      Attributes V;
+      V.position[0] = label.x + cos_scaled * corner[0] - sin_scaled * corner[1];
+      V.position[1] = label.y + sin_scaled * corner[0] + cos_scaled * corner[1];
+      V.texcoord[0] = rect.x + (corner[0] - x0);
+      V.texcoord[1] = rect.y + (corner[1] - y0);
+      std::copy(color, color + 4, V.color);
+      std::copy(outline_color, outline_color + 4, V.outline_color);
+      V.effects[0] = label.scale;
+      V.effects[1] = outline;
+      V.effects[2] = glow;
+      vertices.push_back(V);
+    }
+  }
+}
+
+
+void RenderTextImpl::MakeVertices() {
+  vertices.clear();
+  batches.clear();
+  vertex_evictions.clear();
+
+  // Group the labels by font, keeping their order within each font
+  std::vector<const Font*> fonts;
+  for (const Label& label : labels) {
+    if (std::find(fonts.begin(), fonts.end(), label.font) == fonts.end()) {
+      fonts.push_back(label.font);
+    }
+  }
+  for (const Font* font : fonts) {
+    Batch batch;
+    batch.font = font;
+    batch.first_vertex = vertices.size();
+    // The glyphs are pinned so that rasterizing one of them can't
+    // evict another that's already in a quad. Their evictions are
+    // recorded afterwards, because the new glyphs may evict others.
+    font->PinGlyphs();
+    for (const Label& label : labels) {
+      if (label.font == font) { AddLabel(label); }
+    }
+    font->UnpinGlyphs();
+    batch.count = vertices.size() - batch.first_vertex;
+    batches.push_back(batch);
+    vertex_evictions[font] = font->Evictions();
+  }
+
+  // Textures for fonts that aren't used any more can go
+  for (auto i = textures.begin(); i != textures.end(); ) {
+    if (vertex_evictions.count(i->first) == 0) {
+      i = textures.erase(i);
+    } else {
+      ++i;
+    }
+  }
+  labels_changed = false;
+}
+
+
+/** Copy the cells that changed since the last copy, or the whole
+ * atlas if the texture is new or a different size. It's one byte per
+ * pixel, as GL_ALPHA, which WebGL 1 has too.
+ */
+void RenderTextImpl::UpdateTexture(const Font* font, bool reset) {
+  FontTexture& font_texture = textures[font];
+  if (font_texture.texture == nullptr) {
+    font_texture.texture.reset(new Texture());
+    font_texture.version = -1;
+  }
+  int version = font->AtlasVersion();
+  if (!reset && font_texture.version == version) { return; }
+
+  int atlas_width = font->AtlasWidth();
+  const Uint8* pixels = font->AtlasPixels();
+  if (reset || font_texture.version < 0 || !font->ChangedRects(font_texture.version, changed_rects)) {
+    font_texture.texture->CopyFromPixels(atlas_width, font->AtlasHeight(), GL_ALPHA,
+                                         const_cast<Uint8*>(pixels));
+  } else {
+    // WebGL 1 doesn't have GL_UNPACK_ROW_LENGTH, so I copy each cell's
+    // rows next to each other first; cells are small
+    glBindTexture(GL_TEXTURE_2D, font_texture.texture->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (const SDL_Rect& rect : changed_rects) {
+      cell_pixels.resize(rect.w * rect.h);
+      for (int y = 0; y < rect.h; y++) {
+        const Uint8* row = pixels + (rect.y + y) * atlas_width + rect.x;
+        std::copy(row, row + rect.w, &cell_pixels[y * rect.w]);
+      }
+      glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.w, rect.h,
+                      GL_ALPHA, GL_UNSIGNED_BYTE, cell_pixels.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GLERRORS("Font atlas update");
+  }
+  font_texture.version = version;
+}
+
+
+void RenderText::Render(SDL_Window* window, bool reset) {
+  bool vertices_changed = reset || self->VerticesChanged();
+  if (vertices_changed) {
+    self->MakeVertices();
+  }
+  if (self->vertices.empty()) { return; }
+
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  // Labels are positioned in the drawable's pixels, so that glyphs
+  // map one to one onto pixels even on a high dpi display
+  int sdl_window_width, sdl_window_height;
+  SDL_GL_GetDrawableSize(window, &sdl_window_width, &sdl_window_height);
+
+  glBindBuffer(GL_ARRAY_BUFFER, self->vbo.id);
+  if (vertices_changed) {
+    glBufferData(GL_ARRAY_BUFFER,
+                 sizeof(Attributes) * self->vertices.size(),
+                 self->vertices.data(),
+                 GL_DYNAMIC_DRAW);
+  }
+
+  glActiveTexture(GL_TEXTURE0);
+  const TextProgram* program = nullptr;
+  for (const Batch& batch : self->batches) {
+    // The program only changes between bitmap and distance field fonts
+    int spread = batch.font->SDFSpread();
+    const TextProgram* batch_program = spread > 0? &self->sdf_program : &self->bitmap_program;
+    if (batch_program != program) {
+      if (program != nullptr) { program->Unuse(); }
+      program = batch_program;
+      program->Use(sdl_window_width, sdl_window_height);
+    }
+
+    self->UpdateTexture(batch.font, reset);
+    glBindTexture(GL_TEXTURE_2D, self->textures[batch.font].texture->id);
+    glUniform2f(program->loc_u_texture_size,
+                float(batch.font->AtlasWidth()), float(batch.font->AtlasHeight()));
+    glUniform1f(program->loc_u_spread, float(spread));
+    glDrawArrays(GL_TRIANGLES, batch.first_vertex, batch.count);
+  }
+  program->Unuse();
+  GLERRORS("draw arrays");
+
+  glDisable(GL_BLEND);
+}
@@ -0,0 +1,51 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+// Render text on the GPU from each font's glyph atlas, instead of
+// drawing it into a surface
+
+#ifndef RENDER_TEXT_H
+#define RENDER_TEXT_H
+
+#include "render-layer.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+struct SDL_Window;
+class Font;
+struct RenderTextImpl;
+
+
+struct Label {
+  const Font* font;
+  std::string text;
+  float x, y; // start of the baseline, in drawable pixels, y down
+  float r = 1.0f, g = 1.0f, b = 1.0f, a = 1.0f;
+  float scale = 1.0f, rotation_degrees = 0.0f; // around x,y
+
+  // Only for distance field fonts: an outline around the glyphs, and
+  // a glow fading out beyond it, in the font's pixels. Together they
+  // can reach as far as the font's SDFSpread.
+  float outline = 0.0f, glow = 0.0f;
+  float outline_r = 0.0f, outline_g = 0.0f, outline_b = 0.0f, outline_a = 0.0f;
+};
+
+
+class RenderText: public IRenderLayer {
+public:
+  RenderText();
+  ~RenderText();
+  virtual void Render(SDL_Window* window, bool reset);
+
+  // The labels stay until they're replaced. All the labels with the
+  // same font are drawn with one draw call. The fonts have to outlive
+  // the labels.
+  void SetLabels(const std::vector<Label>& labels);
+
+protected:
+  std::unique_ptr<RenderTextImpl> self;
+};
+
+
+#endif
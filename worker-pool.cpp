@@ -0,0 +1,128 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+#include "worker-pool.h"
+
+#include <SDL.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Emscripten only has threads when built with -pthread
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define WORKER_POOL_THREADS 0
+#else
+#define WORKER_POOL_THREADS 1
+#endif
+
+/* Each ParallelFor() is a "job". The job is split into chunks, and
+   the workers and the caller take chunks until there are none
+   left. The generation number tells the workers a new job started. */
+
+struct WorkerPoolImpl {
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable job_started;
+  std::condition_variable job_finished;
+  bool shutting_down = false;
+  unsigned generation = 0;
+  int busy_workers = 0;
+
+  // The current job
+  const std::function<void(int, int)>* fn = nullptr;
+  int n = 0;
+  int chunk = 1;
+  std::atomic<int> next{0};
+
+  void RunChunks();
+  void WorkerLoop();
+};
+
+
+void WorkerPoolImpl::RunChunks() {
+  while (true) {
+    int begin = next.fetch_add(chunk);
+    if (begin >= n) { break; }
+    (*fn)(begin, std::min(n, begin + chunk));
+  }
+}
+
+
+void WorkerPoolImpl::WorkerLoop() {
+  unsigned seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      job_started.wait(lock, [&] { return shutting_down || generation != seen_generation; });
+      if (shutting_down) { return; }
+      seen_generation = generation;
+    }
+
+    RunChunks();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busy_workers--;
+    }
+    job_finished.notify_one();
+  }
+}
+
+
+WorkerPool::WorkerPool(int threads): self(new WorkerPoolImpl) {
+#if WORKER_POOL_THREADS
+  if (threads < 0) { threads = std::max(0, SDL_GetCPUCount() - 1); }
+  for (int i = 0; i < threads; i++) {
+    self->threads.emplace_back(&WorkerPoolImpl::WorkerLoop, self.get());
+  }
+#endif
+}
+
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(self->mutex);
+    self->shutting_down = true;
+  }
+  self->job_started.notify_all();
+  for (auto& thread : self->threads) {
+    thread.join();
+  }
+}
+
+
+int WorkerPool::Size() const {
+  return self->threads.size() + 1;
+}
+
+
+void WorkerPool::ParallelFor(int n, int min_chunk, const std::function<void(int, int)>& fn) {
+  if (n <= 0) { return; }
+  // A few chunks per thread evens out chunks that take longer
+  int chunk = std::max(std::max(1, min_chunk), n / (4 * Size()));
+  if (self->threads.empty() || chunk >= n) {
+    fn(0, n);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(self->mutex);
+    self->fn = &fn;
+    self->n = n;
+    self->chunk = chunk;
+    self->next = 0;
+    self->busy_workers = self->threads.size();
+    self->generation++;
+  }
+  self->job_started.notify_all();
+
+  self->RunChunks();
+
+  std::unique_lock<std::mutex> lock(self->mutex);
+  self->job_finished.wait(lock, [&] { return self->busy_workers == 0; });
+  self->fn = nullptr;
+}
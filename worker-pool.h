@@ -0,0 +1,37 @@
+// Copyright 2026 Red Blob Games <redblobgames@gmail.com>
+// License: Apache v2.0 <http://www.apache.org/licenses/LICENSE-2.0.html>
+
+/** A fixed set of threads for splitting up loops whose iterations
+ * don't depend on each other.
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "common.h"
+#include <functional>
+#include <memory>
+
+struct WorkerPoolImpl;
+
+class WorkerPool: nocopy {
+public:
+  // With threads < 0, use one thread per cpu core other than the
+  // main one. With threads == 0, everything runs on the calling thread.
+  WorkerPool(int threads = -1);
+  ~WorkerPool();
+
+  // Call fn(begin, end) on chunks covering [0, n), using the workers
+  // and the calling thread. Chunks are at least min_chunk long, except
+  // for the last one. Returns when all the chunks are done. Only one
+  // thread should call this at a time.
+  void ParallelFor(int n, int min_chunk, const std::function<void(int, int)>& fn);
+
+  // Number of threads that share the work, including the caller
+  int Size() const;
+  
+private:
+  std::unique_ptr<WorkerPoolImpl> self;
+};
+
+#endif